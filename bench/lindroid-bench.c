@@ -0,0 +1,630 @@
+/* Lindroid transport benchmark */
+/* SPDX-FileCopyrightText: Copyright © 2024 Lindroid project */
+/* SPDX-License-Identifier: MIT */
+
+/*
+ * Runs the transport of the module against a fake host that echoes all
+ * playback back as capture. The graph side is simulated by a thread that
+ * wakes up every quantum, converts a period of planar F32 into the S16
+ * playback ring and reads a period back from the capture ring. Audio
+ * travels as framed packets over a socketpair, or through shared memory
+ * rings laid out like the ones the module hands to the host. The rings,
+ * the framing and the socket code are the module's own: the graph sends
+ * without blocking and a receive thread fills the capture ring.
+ *
+ *   lindroid-bench [-t socket|shm] [-q quantum] [-r rate] [-c channels]
+ *                  [-d seconds] [-f] [-C]
+ *
+ * -f runs the same number of cycles back to back instead of at the audio
+ * rate, to find the throughput limit. -C forces the plain C conversion
+ * kernels.
+ *
+ * Before running, every compiled conversion kernel is checked against the
+ * scalar conversion, out of range samples included.
+ *
+ * The round trip is measured per period, from the cycle that wrote it to
+ * the cycle that read it back, so it includes the wait for the next cycle.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <spa/support/cpu.h>
+#include <spa/utils/ringbuffer.h>
+
+#include "module-lindroid/protocol.h"
+#include "module-lindroid/format-ops.h"
+#include "module-lindroid/transport.h"
+
+#define MAX_CHANNELS 8
+#define MAX_QUANTUM 8192
+#define RING_SIZE (1u << 20)
+/* periods that may be in flight at once */
+#define LATENCY_SLOTS 1024
+
+enum transport {
+	TRANSPORT_SOCKET,
+	TRANSPORT_SHM,
+};
+
+struct stats {
+	double *values;
+	uint64_t n_values;
+	uint64_t max_values;
+};
+
+struct bench {
+	enum transport transport;
+	uint32_t quantum;
+	uint32_t rate;
+	uint32_t channels;
+	uint32_t seconds;
+	bool flood;
+	bool plain_c;
+
+	struct format_ops ops;
+	uint32_t frame_size;
+	uint32_t period_size;
+
+	int fd[2];		/* module side, host side */
+	int eventfd;
+	struct lindroid_shm_header *shm;
+	size_t shm_size;
+	struct ring playback;
+	struct ring capture;
+
+	pthread_t host;
+	pthread_t receiver;
+	bool running;
+
+	/* graph side, the receive thread only writes the capture ring */
+	float *planes[MAX_CHANNELS];
+	int16_t *s16;
+	struct packet_writer send;
+	struct packet_reader recv;
+	uint32_t seq;
+	uint64_t sent_frames;
+	uint64_t received_frames;
+	uint64_t send_time[LATENCY_SLOTS];
+	bool capture_started;
+
+	uint64_t bytes;
+	uint64_t packets;
+	uint64_t capture_xruns;
+	uint64_t playback_xruns;
+	uint64_t host_drops;
+
+	struct stats latency;
+	struct stats cycle;
+};
+
+static uint64_t now_nsec(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int stats_init(struct stats *s, uint64_t max_values)
+{
+	s->values = calloc(max_values, sizeof(double));
+	s->n_values = 0;
+	s->max_values = max_values;
+	return s->values ? 0 : -errno;
+}
+
+static void stats_add(struct stats *s, double value)
+{
+	if (s->n_values < s->max_values)
+		s->values[s->n_values++] = value;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+	return da < db ? -1 : da > db;
+}
+
+static double stats_percentile(struct stats *s, double p)
+{
+	uint64_t i;
+
+	if (s->n_values == 0)
+		return 0.0;
+	i = (uint64_t)(p / 100.0 * (s->n_values - 1) + 0.5);
+	return s->values[i];
+}
+
+static double stats_average(struct stats *s)
+{
+	double sum = 0.0;
+	uint64_t i;
+
+	for (i = 0; i < s->n_values; i++)
+		sum += s->values[i];
+	return s->n_values ? sum / s->n_values : 0.0;
+}
+
+/* finish a packet on a socket the other end keeps draining */
+static int send_packet(int fd, struct packet_writer *w)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+	ssize_t res;
+
+	while (!packet_writer_done(w)) {
+		res = packet_writer_send(w, fd);
+		if (res == -EAGAIN)
+			poll(&pfd, 1, -1);
+		else if (res < 0 && res != -EINTR)
+			return res;
+	}
+	return 0;
+}
+
+/* echo every playback packet back as a capture packet */
+static void host_socket(struct bench *b)
+{
+	uint8_t payload[LINDROID_MAX_PACKET_SIZE];
+	struct packet_reader *r;
+	struct packet_writer w;
+	struct lindroid_header hdr;
+	struct iovec iov;
+	uint32_t resyncs = 0;
+
+	if ((r = calloc(1, sizeof(*r))) == NULL)
+		return;
+	spa_zero(w);
+
+	while (packet_reader_header(r, b->fd[1], &hdr, sizeof(payload), &resyncs) == 0) {
+		iov.iov_base = payload;
+		iov.iov_len = hdr.length;
+		if (packet_reader_recv(r, b->fd[1], &iov, 1) < 0)
+			break;
+
+		packet_writer_prepare(&w, LINDROID_PACKET_CAPTURE, hdr.stream, hdr.format,
+				hdr.seq, hdr.timestamp, hdr.length);
+		w.data = payload;
+		if (send_packet(b->fd[1], &w) < 0)
+			break;
+	}
+	free(r);
+}
+
+/* copy the playback ring into the capture ring on every wakeup */
+static void host_shm(struct bench *b)
+{
+	struct pollfd pfd = { .fd = b->eventfd, .events = POLLIN };
+	uint8_t chunk[4096];
+	uint32_t rindex, windex, len;
+	int32_t avail;
+	eventfd_t count;
+
+	while (__atomic_load_n(&b->running, __ATOMIC_ACQUIRE)) {
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+		eventfd_read(b->eventfd, &count);
+
+		while ((avail = spa_ringbuffer_get_read_index(b->playback.rb, &rindex)) > 0) {
+			len = SPA_MIN((uint32_t)avail, sizeof(chunk));
+			spa_ringbuffer_read_data(b->playback.rb, b->playback.data, b->playback.size,
+					rindex & b->playback.mask, chunk, len);
+			spa_ringbuffer_read_update(b->playback.rb, rindex + len);
+
+			if (ring_free(&b->capture, &windex) < len) {
+				b->host_drops++;
+				continue;
+			}
+			spa_ringbuffer_write_data(b->capture.rb, b->capture.data, b->capture.size,
+					windex & b->capture.mask, chunk, len);
+			spa_ringbuffer_write_update(b->capture.rb, windex + len);
+		}
+	}
+}
+
+static void *host_thread(void *data)
+{
+	struct bench *b = data;
+
+	if (b->transport == TRANSPORT_SOCKET)
+		host_socket(b);
+	else
+		host_shm(b);
+	return NULL;
+}
+
+/* send all queued playback in packets of at most LINDROID_MAX_PACKET_SIZE.
+ * The socket never blocks, a full one is waited for while the receive
+ * thread keeps taking capture off the host. */
+static void send_playback(struct bench *b)
+{
+	struct packet_writer *w = &b->send;
+	uint32_t index, len;
+	int32_t avail;
+	int res;
+
+	while ((avail = spa_ringbuffer_get_read_index(b->playback.rb, &index)) > 0) {
+		len = SPA_MIN((uint32_t)avail, SPA_ROUND_DOWN(LINDROID_MAX_PACKET_SIZE -
+					sizeof(struct lindroid_header), b->frame_size));
+
+		packet_writer_prepare(w, LINDROID_PACKET_PLAYBACK, 0, LINDROID_FORMAT_S16LE,
+				b->seq++, b->sent_frames - avail / b->frame_size, len);
+		w->data = NULL;
+		w->ring = &b->playback;
+		w->index = index;
+
+		if ((res = send_packet(b->fd[0], w)) < 0) {
+			fprintf(stderr, "send failed: %s\n", strerror(-res));
+			return;
+		}
+		spa_ringbuffer_read_update(b->playback.rb, index + len);
+		b->bytes += len;
+		b->packets++;
+	}
+}
+
+/* move capture packets from the socket into the capture ring, like the
+ * receive thread of the module */
+static void *receive_thread(void *data)
+{
+	struct bench *b = data;
+	struct lindroid_header hdr;
+	struct iovec iov[2];
+	uint32_t index, resyncs = 0;
+	int n_iov, res;
+
+	while ((res = packet_reader_header(&b->recv, b->fd[0], &hdr,
+					b->capture.size, &resyncs)) == 0) {
+		if (ring_free(&b->capture, &index) < hdr.length) {
+			b->host_drops++;
+			res = packet_reader_discard(&b->recv, b->fd[0], hdr.length);
+		} else {
+			n_iov = ring_iov(&b->capture, index, hdr.length, iov);
+			if ((res = packet_reader_recv(&b->recv, b->fd[0], iov, n_iov)) == 0)
+				spa_ringbuffer_write_update(b->capture.rb, index + hdr.length);
+		}
+		if (res < 0)
+			break;
+	}
+	if (res != -EPIPE && __atomic_load_n(&b->running, __ATOMIC_ACQUIRE))
+		fprintf(stderr, "receive failed: %s\n", strerror(-res));
+	return NULL;
+}
+
+/* one graph cycle: read a period of capture, write a period of playback */
+static void cycle(struct bench *b, uint64_t cycle_nsec)
+{
+	void *planes[MAX_CHANNELS];
+	const void *src[1];
+	void *dst[1];
+	uint32_t c, index, k;
+	int32_t avail;
+
+	for (c = 0; c < b->channels; c++)
+		planes[c] = b->planes[c];
+
+	avail = spa_ringbuffer_get_read_index(b->capture.rb, &index);
+	if (avail >= (int32_t)b->period_size) {
+		spa_ringbuffer_read_data(b->capture.rb, b->capture.data, b->capture.size,
+				index & b->capture.mask, b->s16, b->period_size);
+		spa_ringbuffer_read_update(b->capture.rb, index + b->period_size);
+		src[0] = b->s16;
+		b->ops.s16_to_f32d(planes, src, b->channels, b->quantum);
+
+		k = (b->received_frames / b->quantum) % LATENCY_SLOTS;
+		b->received_frames += b->quantum;
+		stats_add(&b->latency, (cycle_nsec - b->send_time[k]) / 1e6);
+		b->capture_started = true;
+	} else if (b->capture_started) {
+		b->capture_xruns++;
+	}
+
+	/* the capture went into the planes, play something else */
+	for (c = 0; c < b->channels; c++)
+		planes[c] = b->planes[c] + b->quantum;
+
+	if (ring_free(&b->playback, &index) < b->period_size) {
+		b->playback_xruns++;
+	} else {
+		dst[0] = b->s16;
+		b->ops.f32d_to_s16(dst, (const void **)planes, b->channels, b->quantum);
+		spa_ringbuffer_write_data(b->playback.rb, b->playback.data, b->playback.size,
+				index & b->playback.mask, b->s16, b->period_size);
+		spa_ringbuffer_write_update(b->playback.rb, index + b->period_size);
+
+		b->send_time[(b->sent_frames / b->quantum) % LATENCY_SLOTS] = cycle_nsec;
+		b->sent_frames += b->quantum;
+	}
+
+	if (b->transport == TRANSPORT_SOCKET) {
+		send_playback(b);
+	} else {
+		eventfd_write(b->eventfd, 1);
+		b->bytes += b->period_size;
+		b->packets++;
+	}
+}
+
+static int setup_transport(struct bench *b)
+{
+	uint32_t offset = SPA_ROUND_UP_N(sizeof(struct lindroid_shm_header), 64);
+	int memfd = -1;
+	void *p;
+
+	if (b->transport == TRANSPORT_SOCKET &&
+	    socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, b->fd) < 0)
+		return -errno;
+
+	/* the rings exist in both modes, shared with the host only for shm */
+	b->shm_size = offset + 2 * RING_SIZE;
+	if (b->transport == TRANSPORT_SHM) {
+		if ((memfd = memfd_create("lindroid-bench", MFD_CLOEXEC)) < 0 ||
+		    ftruncate(memfd, b->shm_size) < 0)
+			return -errno;
+		if ((b->eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+			return -errno;
+		p = mmap(NULL, b->shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+		close(memfd);
+	} else {
+		p = mmap(NULL, b->shm_size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+	if (p == MAP_FAILED)
+		return -errno;
+
+	b->shm = p;
+	ring_init(&b->playback, b->shm, &b->shm->playback, offset, RING_SIZE);
+	ring_init(&b->capture, b->shm, &b->shm->capture, offset + RING_SIZE, RING_SIZE);
+	return 0;
+}
+
+static int setup_buffers(struct bench *b)
+{
+	uint32_t c, i;
+
+	for (c = 0; c < b->channels; c++) {
+		/* a capture period followed by a playback period */
+		b->planes[c] = calloc(2 * b->quantum, sizeof(float));
+		if (b->planes[c] == NULL)
+			return -errno;
+		for (i = 0; i < b->quantum; i++)
+			b->planes[c][b->quantum + i] = 0.5f *
+				sinf(2.0f * (float)M_PI * 440.0f * (c + 1) * i / b->rate);
+	}
+	b->s16 = calloc(1, b->period_size);
+	if (b->s16 == NULL)
+		return -errno;
+	return 0;
+}
+
+static const struct format_ops kernels[] = {
+	{ "c", conv_f32d_to_s16_c, conv_s16_to_f32d_c },
+#if defined(HAVE_SSE2)
+	{ "sse2", conv_f32d_to_s16_sse2, conv_s16_to_f32d_sse2 },
+#endif
+#if defined(HAVE_NEON)
+	{ "neon", conv_f32d_to_s16_neon, conv_s16_to_f32d_neon },
+#endif
+};
+
+/* samples the kernels must clip like the scalar conversion */
+static const float edge_samples[] = {
+	0.0f, -0.0f, 1.0f, -1.0f, 0.99999f, -0.99999f, 1.00001f, -1.00001f,
+	1.5f, -1.5f, 2.0f, -2.0f, 1e9f, -1e9f, INFINITY, -INFINITY,
+	0.5f / LINDROID_S16_SCALE, -0.5f / LINDROID_S16_SCALE,
+	1.5f / LINDROID_S16_SCALE, -1.5f / LINDROID_S16_SCALE,
+};
+
+/*
+ * Compares every compiled kernel against the scalar conversion, for all
+ * channel counts and with a tail that the vector loops leave over.
+ */
+static int check_kernels(void)
+{
+	static float planes[MAX_CHANNELS][MAX_QUANTUM], back[MAX_CHANNELS][MAX_QUANTUM];
+	static int16_t s16[MAX_CHANNELS * MAX_QUANTUM];
+	const uint32_t n_edge = SPA_N_ELEMENTS(edge_samples);
+	const uint32_t n_frames = 4 * n_edge + 3;
+	void *dst[MAX_CHANNELS], *s16_dst[1] = { s16 };
+	const void *src[MAX_CHANNELS], *s16_src[1] = { s16 };
+	uint32_t i, c, n, failed = 0;
+
+	for (c = 0; c < MAX_CHANNELS; c++) {
+		for (n = 0; n < n_frames; n++) {
+			if (n < n_edge)
+				planes[c][n] = edge_samples[(n + c) % n_edge];
+			else
+				planes[c][n] = sinf(n * 0.37f + c) * 1.25f;
+		}
+	}
+
+	for (i = 0; i < SPA_N_ELEMENTS(kernels); i++) {
+		for (c = 1; c <= MAX_CHANNELS; c++) {
+			for (n = 0; n < c; n++) {
+				src[n] = planes[n];
+				dst[n] = back[n];
+			}
+			memset(s16, 0, sizeof(s16));
+			kernels[i].f32d_to_s16(s16_dst, src, c, n_frames);
+			kernels[i].s16_to_f32d(dst, s16_src, c, n_frames);
+
+			for (n = 0; n < c * n_frames; n++) {
+				float v = planes[n % c][n / c];
+				int16_t expect = lindroid_f32_to_s16(v);
+
+				if (s16[n] != expect) {
+					fprintf(stderr, "%s f32d_to_s16: %u channels, sample %u: "
+							"%g gave %d, expected %d\n", kernels[i].name,
+							c, n, v, s16[n], expect);
+					failed++;
+					break;
+				}
+				if (back[n % c][n / c] != lindroid_s16_to_f32(expect)) {
+					fprintf(stderr, "%s s16_to_f32d: %u channels, sample %u: "
+							"%d gave %g, expected %g\n", kernels[i].name,
+							c, n, expect, back[n % c][n / c],
+							lindroid_s16_to_f32(expect));
+					failed++;
+					break;
+				}
+			}
+		}
+	}
+	return failed ? -EINVAL : 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-t socket|shm] [-q quantum] [-r rate] "
+			"[-c channels] [-d seconds] [-f] [-C]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench b;
+	struct timespec next;
+	uint64_t start, end, cpu_start, cpu_end, t, n_cycles, i;
+	double elapsed;
+	int opt, res;
+
+	memset(&b, 0, sizeof(b));
+	b.transport = TRANSPORT_SOCKET;
+	b.quantum = 256;
+	b.rate = 48000;
+	b.channels = 2;
+	b.seconds = 5;
+	b.fd[0] = b.fd[1] = b.eventfd = -1;
+
+	while ((opt = getopt(argc, argv, "t:q:r:c:d:fCh")) != -1) {
+		switch (opt) {
+		case 't':
+			if (strcmp(optarg, "socket") == 0)
+				b.transport = TRANSPORT_SOCKET;
+			else if (strcmp(optarg, "shm") == 0)
+				b.transport = TRANSPORT_SHM;
+			else
+				goto usage;
+			break;
+		case 'q':
+			b.quantum = atoi(optarg);
+			break;
+		case 'r':
+			b.rate = atoi(optarg);
+			break;
+		case 'c':
+			b.channels = atoi(optarg);
+			break;
+		case 'd':
+			b.seconds = atoi(optarg);
+			break;
+		case 'f':
+			b.flood = true;
+			break;
+		case 'C':
+			b.plain_c = true;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (b.quantum == 0 || b.quantum > MAX_QUANTUM || b.rate == 0 ||
+	    b.channels == 0 || b.channels > MAX_CHANNELS || b.seconds == 0)
+		goto usage;
+
+	b.frame_size = b.channels * sizeof(int16_t);
+	b.period_size = b.quantum * b.frame_size;
+	n_cycles = (uint64_t)b.seconds * b.rate / b.quantum;
+
+	if (check_kernels() < 0) {
+		fprintf(stderr, "conversion kernels disagree with the scalar code\n");
+		return 1;
+	}
+	format_ops_init(&b.ops, b.plain_c ? 0 :
+			SPA_CPU_FLAG_SSE2 | SPA_CPU_FLAG_NEON);
+
+	if ((res = setup_transport(&b)) < 0 ||
+	    (res = setup_buffers(&b)) < 0 ||
+	    (res = stats_init(&b.latency, n_cycles)) < 0 ||
+	    (res = stats_init(&b.cycle, n_cycles)) < 0) {
+		fprintf(stderr, "setup failed: %s\n", strerror(-res));
+		return 1;
+	}
+
+	b.running = true;
+	if ((res = pthread_create(&b.host, NULL, host_thread, &b)) != 0) {
+		fprintf(stderr, "can't start the host: %s\n", strerror(res));
+		return 1;
+	}
+	if (b.transport == TRANSPORT_SOCKET &&
+	    (res = pthread_create(&b.receiver, NULL, receive_thread, &b)) != 0) {
+		fprintf(stderr, "can't start the receiver: %s\n", strerror(res));
+		return 1;
+	}
+
+	printf("transport %s, quantum %u, rate %u, channels %u, %s kernels%s\n",
+			b.transport == TRANSPORT_SOCKET ? "socket" : "shm",
+			b.quantum, b.rate, b.channels, b.ops.name,
+			b.flood ? ", free running" : "");
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	start = now_nsec(CLOCK_MONOTONIC);
+	cpu_start = now_nsec(CLOCK_THREAD_CPUTIME_ID);
+
+	for (i = 0; i < n_cycles; i++) {
+		if (!b.flood) {
+			t = next.tv_nsec + (uint64_t)b.quantum * 1000000000ull / b.rate;
+			next.tv_sec += t / 1000000000ull;
+			next.tv_nsec = t % 1000000000ull;
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+		}
+		t = now_nsec(CLOCK_MONOTONIC);
+		cycle(&b, t);
+		stats_add(&b.cycle, (now_nsec(CLOCK_MONOTONIC) - t) / 1e3);
+	}
+
+	end = now_nsec(CLOCK_MONOTONIC);
+	cpu_end = now_nsec(CLOCK_THREAD_CPUTIME_ID);
+
+	__atomic_store_n(&b.running, false, __ATOMIC_RELEASE);
+	if (b.transport == TRANSPORT_SOCKET) {
+		shutdown(b.fd[0], SHUT_RDWR);
+		pthread_join(b.receiver, NULL);
+	}
+	pthread_join(b.host, NULL);
+
+	elapsed = (end - start) / 1e9;
+	qsort(b.latency.values, b.latency.n_values, sizeof(double), compare_double);
+	qsort(b.cycle.values, b.cycle.n_values, sizeof(double), compare_double);
+
+	printf("periods: %" PRIu64 " in %.2f s, xruns: %" PRIu64 " capture, %" PRIu64
+			" playback, %" PRIu64 " dropped by the host\n",
+			n_cycles, elapsed, b.capture_xruns, b.playback_xruns, b.host_drops);
+	printf("throughput: %.2f MB/s, %.0f packets/s each way\n",
+			b.bytes / elapsed / 1e6, b.packets / elapsed);
+	printf("cycle: avg %.2f us, p99 %.2f us, cpu %.2f us per period\n",
+			stats_average(&b.cycle), stats_percentile(&b.cycle, 99.0),
+			(cpu_end - cpu_start) / 1e3 / n_cycles);
+	printf("round trip: p50 %.3f ms, p99 %.3f ms, p99.9 %.3f ms\n",
+			stats_percentile(&b.latency, 50.0),
+			stats_percentile(&b.latency, 99.0),
+			stats_percentile(&b.latency, 99.9));
+
+	return 0;
+
+usage:
+	usage(argv[0]);
+	return 2;
+}
@@ -6,27 +6,46 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <inttypes.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <linux/sockios.h>
 
 #include <spa/utils/result.h>
 #include <spa/utils/string.h>
 #include <spa/utils/json.h>
 #include <spa/utils/ringbuffer.h>
+#include <spa/utils/atomic.h>
+#include <spa/utils/dll.h>
+#include <spa/node/io.h>
+#include <spa/support/cpu.h>
 #include <spa/debug/types.h>
 #include <spa/pod/builder.h>
 #include <spa/param/audio/format-utils.h>
 #include <spa/param/audio/raw.h>
+#include <spa/param/buffers.h>
+#include <spa/param/latency-utils.h>
 
 
 #include <pipewire/impl.h>
 #include <pipewire/i18n.h>
+#include <pipewire/thread.h>
 
-#include <pthread.h>
+#include "module-lindroid/protocol.h"
+#include "module-lindroid/format-ops.h"
+#include "module-lindroid/codec.h"
+#include "module-lindroid/transport.h"
 
 /** \page page_module_fallback_sink Lindroid Sink
  *
@@ -35,11 +54,176 @@
  * ## Module Name
  *
  * `libpipewire-module-lindroid'
+ *
+ * ## Module Options
+ *
+ * - `socket.path`: the socket of the host app to connect to. Default
+ *   `/lindroid/audio_socket`. Load the module once per socket to get separate
+ *   sinks and sources, for example for media and voice calls. The nodes
+ *   stay around while the host app is not running, the module connects as
+ *   soon as the socket shows up and reconnects when the host goes away.
+ *   Connecting never blocks, so a slow host does not hold up the daemon.
+ * - `node.name`, `node.description`: base name and description of the nodes,
+ *   the sink becomes "<name> Sink" and the source "<name> Source". Default
+ *   "Lindroid" and "Lindroid audio".
+ * - `audio.format`, `audio.rate`, `audio.channels`, `audio.position`: the
+ *   format proposed to the host for both streams. The host may answer with a
+ *   different rate and sample format, those are then used instead. Default
+ *   S16LE, 48000, stereo playback and mono capture. Supported formats are
+ *   S16LE, S24LE, S32LE and F32LE.
+ * - `audio.convert`: when the host format is S16LE, run the streams in the
+ *   planar F32 format of the graph and convert inside the module instead of
+ *   leaving it to an audioconvert node. Default true.
+ * - `sink.props`, `source.props`: extra properties for the sink and source
+ *   streams, these override the audio keys above.
+ * - `playback.streams`: an array of properties for further sinks, up to 7,
+ *   multiplexed over the same connection with their own stream index. Each
+ *   takes the keys of `sink.props`, and `media.role` is passed on to the
+ *   host so it can route the stream. The audio keys above are defaults for
+ *   them too. Only the first sink uses the shared memory rings.
+ * - `socket.protocol`: `framed` for the packet protocol described in
+ *   protocol.h, `legacy` for the prefix byte protocol of older host apps, or
+ *   `auto` (default) to use framed and fall back to legacy when the host does
+ *   not answer the handshake.
+ * - `socket.sndbuf`, `socket.rcvbuf`: socket buffer sizes in bytes, 0
+ *   (default) keeps the system default. On a Unix socket the send buffer
+ *   of each side bounds how much it can have in flight, so a larger
+ *   `socket.sndbuf` lets playback bursts go out with fewer wakeups at the
+ *   cost of latency, which rate matching counts.
+ * - `transport.shm`: offer the host to exchange audio through shared memory
+ *   rings instead of the socket. Used when the host accepts it. Default true.
+ * - `transport.codec`: `pcm` (default) sends raw audio, `opus` offers the
+ *   host to compress the socket audio, for hosts bridged over vsock or the
+ *   network. Applies to S16LE streams at Opus rates with up to two channels,
+ *   and needs a module built with libopus. Audio in the shared memory rings
+ *   is never compressed, so turn `transport.shm` off for remote hosts.
+ * - `transport.codec.bitrate`: Opus bitrate per stream in bits per second.
+ *   Default 64000.
+ * - `latency.profile`: `default`, or `low-latency` for games and voice. The
+ *   latter asks for a quantum of 128 frames, lowers the defaults of the high
+ *   water mark to 20 ms and of the rate matching targets to 10 ms, and asks
+ *   the host for an exclusive AAudio MMAP stream. Combine it with
+ *   `transport.shm` so the host can copy straight from the rings.
+ * - `node.latency`: the latency to request for all streams, overriding the
+ *   profile, as `frames/rate`.
+ * - `latency.force-quantum`: also force the requested quantum on the graph
+ *   with `node.force-quantum`. Default false.
+ * - `playback.high-water.msec`: how much playback audio may be queued for the
+ *   host before the drop policy kicks in, in milliseconds. Default 100.
+ * - `playback.drop-policy`: what to drop when the host does not keep up:
+ *   `oldest` (default) skips queued audio to keep the latency bounded,
+ *   `newest` drops the period that did not fit.
+ * - `playback.batch.periods`, `playback.batch.bytes`: trade latency for
+ *   fewer wakeups and syscalls with small quanta. Playback audio is handed
+ *   to the host once this many periods were collected, or earlier once at
+ *   least this many bytes are queued. Every extra period adds its length to
+ *   the latency, keep the batch below the high water mark. Default 1 period
+ *   and no byte threshold.
+ * - `audio.rate-match`: adapt the resampling rate of both streams so the
+ *   amount of audio queued between the graph and the host stays at its
+ *   target, which absorbs the drift between both clocks. Default true.
+ * - `playback.target-latency.msec`, `capture.target-latency.msec`: the
+ *   amount of queued audio rate matching aims for, in milliseconds. For
+ *   playback this counts the ring and the socket send buffer and should be
+ *   below the high water mark. Default 40.
+ * - `capture.max-latency.msec`: capture audio queued beyond this is skipped
+ *   down to the target, which bounds the microphone latency also without
+ *   rate matching. Default three times the capture target.
+ * - `capture.jitter.adaptive`: raise the capture target to three times the
+ *   measured jitter of the capture packets from the host, up to half the
+ *   maximum. Default true.
+ * - `node.driver`: let the source drive the graph, one cycle for every
+ *   quantum of capture audio the host delivers, so the graph runs at the host
+ *   audio clock and needs no rate matching. Both streams are put in one node
+ *   group. Should the host stop delivering, the graph keeps going at the
+ *   nominal rate. Default false.
+ * - `suspend.silence.msec`: suspend a sink after this many milliseconds of
+ *   silence, so the host can release its audio device, and resume on the
+ *   first period that is not silent. Sinks are also suspended while they
+ *   are paused. 0 (default) keeps sending silence.
+ * - `capture.lazy`: tell the host to capture only while a client records
+ *   from the source, starting when the first one links. With false the host
+ *   captures from the moment it is connected, so recording starts without
+ *   waiting for the host to open its input. Default true.
+ * - `aec.reference`: add an "<name> Echo Reference" source that replays what
+ *   the first sink played, delayed by the latency of playback and capture
+ *   as reported by the host. Each cycle it holds what came out of the
+ *   speaker while the source captured, within a quantum, for an echo
+ *   canceller on the Linux side. The sinks, the source and the reference
+ *   are put in one node group. Default false.
+ * - `capture.underrun-fill`: what to produce when the host did not deliver
+ *   enough capture data in time: `silence` (default), `repeat` the last frame
+ *   or `fade` the last frame out to silence.
+ *
+ * ## Statistics
+ *
+ * Every few seconds the nodes get `lindroid.stats.*` properties, readable
+ * with `pw-cli info` or `pw-dump`: the number of cycles, their average and
+ * longest duration in microseconds, a histogram of the durations, the
+ * lowest and highest queue fill in frames, and the drops, underruns,
+ * overruns, skips and lost packets so far. The source also shows the
+ * capture target and the queued audio in milliseconds and the measured
+ * packet jitter. The histogram counts the cycles below
+ * 16 µs, 32 µs and so on, doubling up to 4 ms, and the longer ones last.
+ * The module gets the bytes and packets per second on the socket in each
+ * direction and the average time spent on one packet. Nothing is updated
+ * for an idle stream.
+ *
+ * Problems on the audio paths, like overruns or failed sends, are logged
+ * when they first happen and then summed up at the same interval for as
+ * long as they go on.
+ *
+ * ## Example configuration
+ *
+ *\code{.unparsed}
+ * context.modules = [
+ * {   name = libpipewire-module-lindroid
+ *     args = {
+ *         #socket.path = /lindroid/audio_socket
+ *         #node.name = Lindroid
+ *         #node.description = "Lindroid audio"
+ *         #audio.format = S16LE
+ *         #audio.rate = 48000
+ *         #audio.convert = true
+ *         #sink.props = { audio.position = [ FL FR ] }
+ *         #source.props = { audio.position = [ MONO ] }
+ *         #playback.streams = [
+ *         #    { node.name = "Lindroid Voice" media.role = Communication audio.channels = 1 }
+ *         #]
+ *         #socket.protocol = auto
+ *         #socket.sndbuf = 0
+ *         #socket.rcvbuf = 0
+ *         #transport.shm = true
+ *         #transport.codec = pcm
+ *         #transport.codec.bitrate = 64000
+ *         #latency.profile = default
+ *         #node.latency = 128/48000
+ *         #latency.force-quantum = false
+ *         #playback.high-water.msec = 100
+ *         #playback.drop-policy = oldest
+ *         #playback.batch.periods = 1
+ *         #playback.batch.bytes = 0
+ *         #audio.rate-match = true
+ *         #node.driver = false
+ *         #playback.target-latency.msec = 40
+ *         #capture.target-latency.msec = 40
+ *         #capture.max-latency.msec = 120
+ *         #capture.jitter.adaptive = true
+ *         #suspend.silence.msec = 0
+ *         #capture.lazy = true
+ *         #aec.reference = false
+ *         #capture.underrun-fill = silence
+ *     }
+ * }
+ * ]
+ *\endcode
  */
 
 #define NAME "lindroid-sink"
 
-#define AUDIO_SOCKET_PATH "/lindroid/audio_socket"
+#define DEFAULT_SOCKET_PATH "/lindroid/audio_socket"
+#define DEFAULT_NAME "Lindroid"
+#define DEFAULT_DESCRIPTION "Lindroid audio"
 
 PW_LOG_TOPIC_STATIC(mod_topic, "mod." NAME);
 #define PW_LOG_TOPIC_DEFAULT mod_topic
@@ -47,13 +231,88 @@ PW_LOG_TOPIC_STATIC(mod_topic, "mod." NAME);
 #define AUDIO_OUTPUT_PREFIX 0x01
 #define AUDIO_INPUT_PREFIX 0x02
 
-#define BUFFER_SIZE 102400
-
-static uint8_t audio_buffer[BUFFER_SIZE];
-static size_t audio_buffer_start = 0;
-static size_t audio_buffer_end = 0;
-static pthread_mutex_t buffer_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t buffer_cond = PTHREAD_COND_INITIALIZER;
+/* audio packets tracked while they sit in the socket send buffer, a default
+ * send buffer holds less than a third of that in the smallest packets */
+#define MAX_INFLIGHT 1024
+
+/* what a unix stream socket charges to the send buffer for one write, the
+ * allocations of unix_stream_sendmsg() with 4 KiB pages: struct sk_buff,
+ * a kmalloc head with the skb_shared_info after it and whole pages for
+ * payload that does not fit the head */
+#define SKB_PAGE_SIZE 4096u
+#define SKB_STRUCT_SIZE 256u
+#define SKB_SHINFO_SIZE 320u
+
+#define HANDSHAKE_TIMEOUT_SEC 1
+
+/* retry delays while the host is away, doubled on every failed attempt.
+ * A socket created in the meantime is picked up right away. */
+#define RECONNECT_MIN_MSEC 50
+#define RECONNECT_MAX_MSEC 2000
+
+#define DEFAULT_FORMAT "S16LE"
+#define DEFAULT_RATE 48000
+#define DEFAULT_POSITION "[ FL FR ]"
+#define DEFAULT_SOURCE_POSITION "[ MONO ]"
+
+#define DEFAULT_HIGH_WATER_MSEC 100
+#define DEFAULT_TARGET_LATENCY_MSEC 40
+
+#define LOW_LATENCY_QUANTUM 128
+#define LOW_LATENCY_HIGH_WATER_MSEC 20
+#define LOW_LATENCY_TARGET_MSEC 10
+
+/* driver mode: how often the io thread looks at the capture ring, and how
+ * many quanta without a cycle before it drives the graph on its own */
+#define DRIVER_POLL_MSEC 2
+#define DRIVER_TIMEOUT_QUANTA 2
+/* the host clock rate is measured over this long, jumps beyond the
+ * maximum difference are not taken as drift */
+#define HOST_RATE_WINDOW_MSEC 1000
+#define HOST_RATE_MAX_DIFF 0.01
+#define DEFAULT_QUANTUM 1024
+
+/* rate matching, errors are in frames */
+#define DLL_PERIOD 1024
+#define MAX_ERROR 256.0f
+
+#define STATS_INTERVAL_SEC 5
+
+/* capture jitter buffer: the target follows this multiple of the measured
+ * jitter, gaps longer than the reset are pauses and not jitter */
+#define JITTER_FACTOR 3
+#define JITTER_RESET_MSEC 500
+
+/* played audio kept for the echo reference, the longest delay it covers */
+#define AEC_HISTORY_MSEC 1000
+
+/* cycle duration histogram, bucket i counts cycles shorter than
+ * 16 µs << i and the last one everything longer */
+#define STATS_HIST_BUCKETS 10
+#define STATS_HIST_SHIFT 14
+
+/* how often the reported latency is refreshed, and by how much it has to
+ * move before the graph is told */
+#define LATENCY_INTERVAL_MSEC 500
+#define LATENCY_THRESHOLD_MSEC 1
+
+/* rings hold the high water mark or target latency and two of the largest
+ * quanta, in the widest sample format and at the highest rate a host may
+ * pick. Hosts asking for more are ignored. */
+#define MAX_HOST_RATE 192000
+#define MIN_BUFFER_SIZE (1u << 17)
+#define MAX_BUFFER_SIZE (1u << 24)
+#define DEFAULT_MAX_QUANTUM 8192
+
+#define DEFAULT_CODEC_BITRATE 64000
+
+/* quieter than the last bit of S16, nobody hears it */
+#define SILENCE_THRESHOLD (1.0f / 32768.0f)
+
+#define MIN_STREAM_BUFFERS 2
+#define MAX_STREAM_BUFFERS 8
+
+#define MAX_PLAYBACK_STREAMS 8
 
 static const struct spa_dict_item module_props[] = {
 	{ PW_KEY_MODULE_AUTHOR, "Luka Panio <lukapanio@gmail.com>" },
@@ -62,14 +321,179 @@ static const struct spa_dict_item module_props[] = {
 	{ PW_KEY_MODULE_VERSION, "1" },
 };
 
-struct bitmap {
-	uint8_t *data;
+enum protocol {
+	PROTOCOL_AUTO,		/* config only: framed, legacy if the host is */
+	PROTOCOL_HANDSHAKE,	/* HELLO sent, waiting for the answer */
+	PROTOCOL_LEGACY,
+	PROTOCOL_FRAMED,
+};
+
+enum drop_policy {
+	DROP_POLICY_OLDEST,
+	DROP_POLICY_NEWEST,
+};
+
+enum underrun_fill {
+	UNDERRUN_FILL_SILENCE,
+	UNDERRUN_FILL_REPEAT,
+	UNDERRUN_FILL_FADE,
+};
+
+struct impl;
+
+/* timing of the process callback, always on. Every field has one writer,
+ * the RT process, and is read by the stats timer, which also resets the
+ * extremes with an exchange. A cycle racing that reset may leave its
+ * extreme out of both intervals. */
+struct cycle_stats {
+	uint64_t cycles;
+	uint64_t nsec;
+	uint32_t max_nsec;
+	uint32_t fill_min;
+	uint32_t fill_max;
+	uint32_t hist[STATS_HIST_BUCKETS];
+};
+
+/* socket traffic of one direction, written by the io thread for sending
+ * and by the receive thread for receiving */
+struct transport_stats {
+	uint64_t bytes;
+	uint64_t packets;
+	uint64_t nsec;
+};
+
+/* messages from the RT process, the io thread and the receive thread. They
+ * are only counted there, the main loop logs the first one after a quiet
+ * interval right away and sums up the rest with the stats. */
+enum rt_message {
+	RT_MSG_PLAYBACK_NO_BUFFER,
+	RT_MSG_CAPTURE_NO_BUFFER,
+	RT_MSG_REFERENCE_NO_BUFFER,
+	RT_MSG_CAPTURE_OVERRUN,
+	RT_MSG_CAPTURE_LOST,
+	RT_MSG_CAPTURE_SKIP,
+	RT_MSG_DECODE_FAILED,
+	RT_MSG_INVALID_PREFIX,
+	RT_MSG_UNEXPECTED_BYTE,
+	RT_MSG_IGNORED_PACKET,
+	RT_MSG_PLAYBACK_SKIP,
+	RT_MSG_ENCODE_FAILED,
+	RT_MSG_SEND_FAILED,
+	N_RT_MESSAGES,
+};
+
+struct rt_message_info {
+	enum spa_log_level level;
+	const char *text;
+	const char *unit;	/* what the values add up to, NULL for an errno */
+};
+
+static const struct rt_message_info rt_messages[N_RT_MESSAGES] = {
+	[RT_MSG_PLAYBACK_NO_BUFFER] = { SPA_LOG_LEVEL_DEBUG, "playback out of buffers", NULL },
+	[RT_MSG_CAPTURE_NO_BUFFER] = { SPA_LOG_LEVEL_DEBUG, "capture out of buffers", NULL },
+	[RT_MSG_REFERENCE_NO_BUFFER] = { SPA_LOG_LEVEL_DEBUG, "echo reference out of buffers",
+		NULL },
+	[RT_MSG_CAPTURE_OVERRUN] = { SPA_LOG_LEVEL_DEBUG, "capture ring overrun", "bytes dropped" },
+	[RT_MSG_CAPTURE_LOST] = { SPA_LOG_LEVEL_DEBUG, "capture packets lost", "packets" },
+	[RT_MSG_CAPTURE_SKIP] = { SPA_LOG_LEVEL_DEBUG, "capture above max latency",
+		"bytes skipped" },
+	[RT_MSG_DECODE_FAILED] = { SPA_LOG_LEVEL_DEBUG, "can't decode capture packet", NULL },
+	[RT_MSG_INVALID_PREFIX] = { SPA_LOG_LEVEL_ERROR, "Invalid packet start byte, expected 0x02",
+		"bytes dropped" },
+	[RT_MSG_UNEXPECTED_BYTE] = { SPA_LOG_LEVEL_DEBUG, "dropping unexpected bytes", "bytes" },
+	[RT_MSG_IGNORED_PACKET] = { SPA_LOG_LEVEL_DEBUG, "ignoring unknown packets", "bytes" },
+	[RT_MSG_PLAYBACK_SKIP] = { SPA_LOG_LEVEL_DEBUG, "playback ring above high water",
+		"bytes skipped" },
+	[RT_MSG_ENCODE_FAILED] = { SPA_LOG_LEVEL_WARN, "can't encode playback", NULL },
+	[RT_MSG_SEND_FAILED] = { SPA_LOG_LEVEL_ERROR, "Failed to send audio data", NULL },
+};
+
+/* one thread writes each message, the counters only grow and the main
+ * loop keeps what it reported. muted is set by the writer when it asks for
+ * the first message to be logged and cleared by the main loop once a whole
+ * interval passed without one. */
+struct rt_message_state {
+	uint32_t count;
+	uint64_t total;
+	uint32_t last;
+	bool muted;
+
+	uint32_t reported_count;
+	uint64_t reported_total;
+	bool announced;
+};
+
+/* one sink, stream 0 is the default one and the only one the shared memory
+ * rings carry */
+struct playback_stream {
+	struct impl *impl;
+	uint32_t id;
+
+	struct spa_audio_info_raw info;
+	struct pw_properties *props;
+	struct pw_stream *stream;
+	struct spa_hook listener;
+
+	/* the RT process writes, the io thread or the host reads */
+	struct ring ring;
+	struct spa_ringbuffer local_rb;
+	uint8_t *local_data;
+	uint32_t high_water;
+
+	uint32_t seq;
+	uint64_t position;
+
+	bool convert;
+	void *scratch;
+	struct codec_encoder *encoder;
+
+	struct spa_io_rate_match *rate_match;
+	struct spa_dll dll;
+	uint32_t target;
+
+	uint32_t drops;
+	uint32_t batched;
+
+	struct cycle_stats stats;
+	struct cycle_stats reported_stats;
+
+	/* idle suspend: paused from the main loop, silent from the RT
+	 * process, what the host was told from the io thread */
+	bool paused;
+	bool silent;
+	uint64_t silent_frames;
+	bool host_suspended;
+
+	/* frames sent but still in the socket, counted by the io thread */
+	uint32_t socket_queued;
+
+	/* latency in frames: queued by us (RT process), reported by the host
+	 * (receive thread), last published (main loop) */
+	uint32_t queued;
+	uint32_t host_buffered;
+	uint32_t host_device;
+	uint32_t reported_latency;
+};
+
+/* an audio packet that went out, in flight until the host reads past end,
+ * in sent_truesize */
+struct inflight {
+	struct playback_stream *pb;
+	uint32_t end;
+	uint32_t frames;
+};
+
+/* sorted registry ids, looked up with a binary search */
+struct id_set {
+	uint32_t *ids;
+	size_t n_ids;
 	size_t size;
-	size_t items;
 };
 
 struct impl {
 	struct pw_context *context;
+	struct pw_loop *main_loop;
+	struct pw_loop *data_loop;
 
 	struct pw_impl_module *module;
 	struct spa_hook module_listener;
@@ -86,336 +510,3238 @@ struct impl {
 	struct pw_properties *properties;
 	struct pw_properties *source_properties;
 
-	struct bitmap sink_ids;
-	struct bitmap fallback_sink_ids;
+	struct id_set sink_ids;
+	struct id_set fallback_sink_ids;
 
+	/* registry events only flag a check, the sync for it goes out once
+	 * per loop iteration from check_event */
 	int check_seq;
+	struct spa_source *check_event;
 
 	unsigned int do_disconnect:1;
 	unsigned int scheduled:1;
+	unsigned int check_queued:1;
 
+	char *socket_path;
 	int audio_socket_fd;
+	int socket_sndbuf;
+	int socket_rcvbuf;
+
+	struct pw_data_loop *io_thread;
+	struct pw_loop *io_loop;
+	struct spa_source *socket_source;
+	struct spa_source *playback_event;
+	uint32_t socket_mask;
+	struct spa_source *handshake_timer;
+
+	/* connection state machine, only touched from the io thread. The
+	 * receive thread lives as long as one connection and flags
+	 * receive_failed before it signals disconnect_event and exits. It is
+	 * made through the thread utils of the context so it gets realtime
+	 * priority like the graph it feeds. */
+	bool connected;
+	uint32_t reconnect_msec;
+	struct spa_source *reconnect_timer;
+	struct spa_source *disconnect_event;
+	int watch_fd;
+	struct spa_source *watch_source;
+	struct spa_thread *receive_thread;
+	bool receive_failed;
+
+	bool low_latency;
+	bool force_quantum;
+	uint32_t max_quantum;
+
+	enum protocol protocol_config;
+	enum protocol protocol;
+	bool hello_pending;
+	struct lindroid_hello send_hello;
+
+	/* both rings live in one mapping, a memfd when it can be shared with
+	 * the host. Each has a single producer and a single consumer: the RT
+	 * process and the io thread (or the host) for playback, the receive
+	 * thread (or the host) and the RT process for capture. */
+	struct lindroid_shm_header *shm;
+	size_t shm_size;
+	int shm_fd;
+	int shm_eventfd;
+	bool shm_pending;
+	bool shm_active;
+	struct lindroid_shm_info send_shm;
+
+	struct playback_stream playbacks[MAX_PLAYBACK_STREAMS];
+	uint32_t n_playbacks;
+	struct ring capture;
+	uint32_t high_water_msec;
+	enum drop_policy drop_policy;
+	uint32_t batch_periods;
+	uint32_t batch_bytes;
+
+	/* streams take turns packet by packet, so a large backlog on one
+	 * does not hold up the others */
+	uint32_t next_playback;
+	uint32_t stream_info_pending;
+	struct lindroid_stream_info send_stream_info;
+
+	/* packet in flight, audio payload stays in the ring until sent */
+	struct packet_writer send;
+	struct playback_stream *send_stream;
+	uint32_t send_frames;
+	struct playback_stream *send_audio;
+
+	/* the socket is shared by all streams, the send buffer use it
+	 * reports after each flush is matched against the audio packets sent
+	 * to tell every stream what it has in flight. Both count what the
+	 * kernel charges for the writes, not payload bytes. */
+	uint32_t sent_truesize;
+	struct inflight inflight[MAX_INFLIGHT];
+	uint32_t inflight_head;
+	uint32_t n_inflight;
+	bool inflight_full;
+
+	/* idle suspend: capture_paused follows the source stream, the io
+	 * thread tells the host with send_state */
+	uint32_t suspend_msec;
+	bool capture_lazy;
+	bool capture_paused;
+	bool capture_host_suspended;
+	struct lindroid_state send_state;
+
+	/* compression of the socket audio, offered in the HELLO. The encoders
+	 * and their buffers belong to the io thread, the decoder and its
+	 * buffers to the receive thread. The main loop creates the decoder for
+	 * the format it applied and leaves it in decoder_pending. */
+	bool codec_offer;
+	uint32_t codec_bitrate;
+	bool codec_active;
+	int16_t codec_pcm[LINDROID_CODEC_MAX_FRAMES * LINDROID_CODEC_MAX_CHANNELS];
+	uint8_t codec_data[LINDROID_CODEC_MAX_PACKET];
+	struct codec_decoder *decoder;
+	struct codec_decoder *decoder_pending;
+	int16_t decoder_pcm[LINDROID_CODEC_MAX_DECODE * LINDROID_CODEC_MAX_CHANNELS];
+	uint8_t decoder_data[LINDROID_CODEC_MAX_PACKET];
+
+	/* owned by the receive thread */
+	struct packet_reader recv;
+
+	uint32_t capture_seq;
+	bool capture_seq_valid;
+	uint64_t capture_timestamp;
+
+	uint32_t capture_queued;
+	uint32_t capture_host_buffered;
+	uint32_t capture_host_device;
+	uint32_t capture_reported_latency;
+	struct spa_source *latency_timer;
 
-	struct spa_audio_info_raw info;
 	struct spa_audio_info_raw source_info;
-	struct pw_properties *stream_props;
+	/* what the receive and io threads use of source_info, stored by the
+	 * data loop when the host changes it */
+	uint32_t capture_format;	/* as a LINDROID_FORMAT */
+	uint32_t capture_frame_size;
+	uint32_t capture_rate;
 	struct pw_properties *source_stream_props;
-	struct pw_stream *stream;
 	struct pw_stream *source_stream;
-	struct spa_hook stream_listener;
 	struct spa_hook source_stream_listener;
+
+	/* streams run in F32P and the module converts to and from the S16
+	 * interleaved ring, decided by the negotiated stream formats */
+	bool convert;
+	bool capture_convert;
+	struct format_ops ops;
+	void *capture_scratch;
+
+	/* echo reference: the history is appended by the RT process of stream
+	 * 0 in its ring format and replayed by the RT process of the
+	 * reference, aec_delay frames behind, set by the latency timer */
+	bool aec_reference;
+	struct ring aec_history;
+	struct spa_ringbuffer aec_rb;
+	uint8_t *aec_data;
+	uint32_t aec_delay;
+	/* owned by the RT process of the reference */
+	uint32_t aec_read;
+	uint32_t aec_read_delay;
+	bool aec_read_valid;
+	struct pw_properties *aec_stream_props;
+	struct pw_stream *aec_stream;
+	struct spa_hook aec_stream_listener;
+
+	/* adaptive resampling on the queue fill, the DLLs are only touched
+	 * from the RT process of their stream once audio flows */
+	bool rate_match;
+	struct spa_io_rate_match *capture_rate_match;
+	struct spa_dll capture_dll;
+	uint32_t playback_target_msec;
+	uint32_t capture_target_msec;
+	uint32_t capture_target;
+
+	/* capture jitter buffer: the receive thread measures the jitter, the
+	 * latency timer derives the target from it and the RT process skips
+	 * what lies beyond the maximum */
+	bool capture_adaptive;
+	uint32_t capture_max_msec;
+	uint32_t capture_max;
+	uint32_t capture_base_target;
+	uint64_t capture_arrival;
+	uint64_t capture_duration;
+	float capture_jitter_ns;
+	uint32_t capture_jitter;
+
+	/* host sample clock at the end of the last capture packet, and the
+	 * measurement of its rate against ours for the driver clock */
+	uint64_t host_clock;
+	uint64_t host_clock_start;
+	uint64_t host_clock_start_nsec;
+	double host_rate_diff;
+	int32_t host_rate_ppm;
+
+	/* driver mode, cycles are triggered from the receive thread or the
+	 * io thread and driver_busy stays set until the source processed */
+	bool driver;
+	struct spa_io_position *position;
+	struct spa_source *driver_timer;
+	bool driver_busy;
+	uint32_t driver_cycles;
+	uint32_t driver_seen_cycles;
+	uint32_t driver_idle_msec;
+
+	enum underrun_fill underrun_fill;
+	uint8_t last_frame[SPA_AUDIO_MAX_CHANNELS * sizeof(int32_t)];
+
+	/* written by one thread each, read from the stats timer */
+	uint32_t capture_underruns;
+	uint32_t capture_overruns;
+	uint32_t capture_lost;
+	uint32_t capture_resyncs;
+	uint32_t capture_skips;
+	uint32_t reported_underruns;
+	uint32_t reported_overruns;
+	uint32_t reported_lost;
+	uint32_t reported_drops;
+	struct cycle_stats capture_stats;
+	struct cycle_stats capture_reported_stats;
+	struct transport_stats send_stats;
+	struct transport_stats recv_stats;
+	struct transport_stats reported_send;
+	struct transport_stats reported_recv;
+	struct spa_source *stats_timer;
+
+	struct rt_message_state rt_state[N_RT_MESSAGES];
+	struct spa_source *rt_message_event;
 };
 
-static void* socket_receive_thread(void* arg) {
-    struct impl *impl = (struct impl*)arg;
-    uint8_t temp_buffer[10241];
-    ssize_t bytesRead;
+static uint32_t sample_size(uint32_t format)
+{
+	switch (format) {
+	case SPA_AUDIO_FORMAT_S8:
+	case SPA_AUDIO_FORMAT_U8:
+		return 1;
+	case SPA_AUDIO_FORMAT_S16_LE:
+	case SPA_AUDIO_FORMAT_S16_BE:
+		return 2;
+	case SPA_AUDIO_FORMAT_S24_LE:
+		return 3;
+	default:
+		return 4;
+	}
+}
 
-    while (1) {
-        bytesRead = recv(impl->audio_socket_fd, temp_buffer, sizeof(temp_buffer), 0);
-        if (bytesRead <= 0) {
-            pw_log_error("Failed to receive audio data: %m");
-            continue;
-        }
+static inline uint64_t get_time_ns(void)
+{
+	struct timespec ts;
 
-        // Check if the packet starts with 0x02
-        if (temp_buffer[0] != 0x02) {
-            pw_log_error("Invalid packet start byte, expected 0x02");
-            continue;
-        }
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return SPA_TIMESPEC_TO_NSEC(&ts);
+}
 
-        pthread_mutex_lock(&buffer_mutex);
+static void cycle_stats_init(struct cycle_stats *s)
+{
+	spa_zero(*s);
+	s->fill_min = UINT32_MAX;
+}
 
-        // Start copying from the second byte
-        for (ssize_t i = 1; i < bytesRead; ++i) {
-            audio_buffer[audio_buffer_end] = temp_buffer[i];
-            audio_buffer_end = (audio_buffer_end + 1) % BUFFER_SIZE;
-            if (audio_buffer_end == audio_buffer_start) {
-                audio_buffer_start = (audio_buffer_start + 1) % BUFFER_SIZE;
-            }
-        }
+/* single writer, so plain increments published with a store, no locked
+ * read-modify-write on the RT path */
+static inline void cycle_stats_fill(struct cycle_stats *s, uint32_t frames)
+{
+	if (frames < s->fill_min)
+		SPA_ATOMIC_STORE(s->fill_min, frames);
+	if (frames > s->fill_max)
+		SPA_ATOMIC_STORE(s->fill_max, frames);
+}
 
-        pthread_cond_signal(&buffer_cond);
-        pthread_mutex_unlock(&buffer_mutex);
-    }
+static inline void cycle_stats_add(struct cycle_stats *s, uint64_t start)
+{
+	uint64_t nsec = get_time_ns() - start;
+	uint64_t slot = nsec >> STATS_HIST_SHIFT;
+	uint32_t bucket = slot == 0 ? 0 :
+		SPA_MIN(64u - __builtin_clzll(slot), STATS_HIST_BUCKETS - 1u);
+
+	SPA_ATOMIC_STORE(s->cycles, s->cycles + 1);
+	SPA_ATOMIC_STORE(s->nsec, s->nsec + nsec);
+	SPA_ATOMIC_STORE(s->hist[bucket], s->hist[bucket] + 1);
+	if (nsec > s->max_nsec)
+		SPA_ATOMIC_STORE(s->max_nsec, (uint32_t)SPA_MIN(nsec, (uint64_t)UINT32_MAX));
+}
 
-    return NULL;
+static inline void transport_stats_add(struct transport_stats *s, uint64_t bytes,
+		uint64_t packets, uint64_t nsec)
+{
+	SPA_ATOMIC_STORE(s->bytes, s->bytes + bytes);
+	SPA_ATOMIC_STORE(s->packets, s->packets + packets);
+	SPA_ATOMIC_STORE(s->nsec, s->nsec + nsec);
 }
 
+/* safe from any thread, never blocks and wakes the main loop at most once
+ * per quiet interval */
+static void rt_message(struct impl *impl, enum rt_message id, uint32_t value)
+{
+	struct rt_message_state *m = &impl->rt_state[id];
+
+	SPA_ATOMIC_STORE(m->last, value);
+	SPA_ATOMIC_STORE(m->total, m->total + value);
+	SPA_ATOMIC_STORE(m->count, m->count + 1);
+
+	if (!SPA_ATOMIC_LOAD(m->muted)) {
+		SPA_ATOMIC_STORE(m->muted, true);
+		pw_loop_signal_event(impl->main_loop, impl->rt_message_event);
+	}
+}
 
-static void stream_destroy(void *d)
+static uint32_t format_to_lindroid(uint32_t format)
 {
-	struct impl *impl = d;
-	spa_hook_remove(&impl->stream_listener);
-	impl->stream = NULL;
+	switch (format) {
+	case SPA_AUDIO_FORMAT_S16_LE:
+		return LINDROID_FORMAT_S16LE;
+	case SPA_AUDIO_FORMAT_S24_LE:
+		return LINDROID_FORMAT_S24LE;
+	case SPA_AUDIO_FORMAT_S32_LE:
+		return LINDROID_FORMAT_S32LE;
+	case SPA_AUDIO_FORMAT_F32_LE:
+		return LINDROID_FORMAT_F32LE;
+	default:
+		return LINDROID_FORMAT_UNKNOWN;
+	}
 }
 
-static void stream_state_changed(void *d, enum pw_stream_state old,
-		enum pw_stream_state state, const char *error)
+static uint32_t format_from_lindroid(uint32_t format)
 {
-	struct impl *impl = d;
-	switch (state) {
-	case PW_STREAM_STATE_ERROR:
-	case PW_STREAM_STATE_UNCONNECTED:
-		pw_impl_module_schedule_destroy(impl->module);
-		break;
-	case PW_STREAM_STATE_PAUSED:
-	case PW_STREAM_STATE_STREAMING:
-		break;
+	switch (format) {
+	case LINDROID_FORMAT_S16LE:
+		return SPA_AUDIO_FORMAT_S16_LE;
+	case LINDROID_FORMAT_S24LE:
+		return SPA_AUDIO_FORMAT_S24_LE;
+	case LINDROID_FORMAT_S32LE:
+		return SPA_AUDIO_FORMAT_S32_LE;
+	case LINDROID_FORMAT_F32LE:
+		return SPA_AUDIO_FORMAT_F32_LE;
 	default:
-		break;
+		return SPA_AUDIO_FORMAT_UNKNOWN;
 	}
 }
 
-static void playback_stream_process(void *d)
+static void format_info_from_raw(struct lindroid_format_info *fi,
+		const struct spa_audio_info_raw *info)
 {
-	struct impl *impl = d;
-	struct pw_buffer *buf;
-	struct spa_data *bd;
-	void *data;
-	uint32_t offs, size;
+	fi->format = format_to_lindroid(info->format);
+	fi->rate = info->rate;
+	fi->channels = info->channels;
+}
+
+/* frames one graph cycle consumes, what a driver cycle waits for */
+static uint32_t driver_quantum(struct impl *impl)
+{
+	struct spa_io_position *position = impl->position;
+
+	return position && position->clock.target_duration ?
+		(uint32_t)position->clock.target_duration : DEFAULT_QUANTUM;
+}
+
+/* as the driver we fill in the graph clock for every cycle we start. The
+ * cycles follow the capture packets, the rate the host clock runs at. */
+static void driver_update_clock(struct impl *impl)
+{
+	struct spa_io_position *position = impl->position;
+	struct spa_io_clock *c;
+	uint64_t nsec = get_time_ns();
+	uint32_t rate;
+	double rate_diff;
+
+	if (position == NULL)
+		return;
+
+	c = &position->clock;
+	rate = c->target_rate.denom ? c->target_rate.denom : SPA_ATOMIC_LOAD(impl->capture_rate);
+	rate_diff = 1.0 + SPA_ATOMIC_LOAD(impl->host_rate_ppm) / 1e6;
+
+	c->nsec = nsec;
+	c->rate = SPA_FRACTION(1, rate);
+	c->position += c->duration;
+	c->duration = driver_quantum(impl);
+	c->delay = 0;
+	c->rate_diff = rate_diff;
+	c->next_nsec = nsec + (uint64_t)(c->duration * SPA_NSEC_PER_SEC / rate / rate_diff);
+}
+
+/* start a cycle when a quantum of capture audio is queued, or right away on
+ * timeout. Called from the receive and the io thread. */
+static void driver_check(struct impl *impl, bool timeout)
+{
+	uint32_t index, frame_size = SPA_ATOMIC_LOAD(impl->capture_frame_size);
+	int32_t avail;
+
+	if (!impl->driver || impl->source_stream == NULL)
+		return;
+
+	avail = spa_ringbuffer_get_read_index(impl->capture.rb, &index);
+	if (!timeout && SPA_MAX(avail, 0) / frame_size < driver_quantum(impl))
+		return;
+
+	if (!SPA_ATOMIC_CAS(impl->driver_busy, false, true))
+		return;
+
+	driver_update_clock(impl);
+	if (pw_stream_trigger_process(impl->source_stream) < 0)
+		SPA_ATOMIC_STORE(impl->driver_busy, false);
+}
+
+/* blocking reads of the audio socket through the read ahead, only from the
+ * receive thread */
+static inline int recv_iov(struct impl *impl, struct iovec *iov, int n_iov)
+{
+	return packet_reader_recv(&impl->recv, impl->audio_socket_fd, iov, n_iov);
+}
+
+static inline int recv_discard(struct impl *impl, uint32_t len)
+{
+	return packet_reader_discard(&impl->recv, impl->audio_socket_fd, len);
+}
+
+/* how fast the host sample clock runs against ours, measured over windows
+ * long enough for the arrival jitter to average out */
+static void update_host_rate(struct impl *impl, uint64_t now, bool restart)
+{
+	uint64_t elapsed = now - impl->host_clock_start_nsec;
+	double measured;
+
+	if (restart || impl->host_clock_start_nsec == 0) {
+		impl->host_clock_start = impl->host_clock;
+		impl->host_clock_start_nsec = now;
+		return;
+	}
+	if (elapsed < HOST_RATE_WINDOW_MSEC * SPA_NSEC_PER_MSEC)
+		return;
+
+	measured = (double)(impl->host_clock - impl->host_clock_start) *
+		SPA_NSEC_PER_SEC / SPA_ATOMIC_LOAD(impl->capture_rate) / elapsed;
+	/* timestamps that jumped, not a clock that drifts */
+	if (fabs(measured - 1.0) < HOST_RATE_MAX_DIFF) {
+		impl->host_rate_diff += (measured - impl->host_rate_diff) / 8.0;
+		SPA_ATOMIC_STORE(impl->host_rate_ppm,
+				(int32_t)lrint((impl->host_rate_diff - 1.0) * 1e6));
+	}
+	impl->host_clock_start = impl->host_clock;
+	impl->host_clock_start_nsec = now;
+}
+
+/* interarrival jitter of the capture packets as in RFC 3550, how much the
+ * gap to the previous packet differs from the audio that one carried.
+ * timestamp is the host sample clock of the first frame. */
+static void capture_arrival(struct impl *impl, uint64_t timestamp, uint32_t frames)
+{
+	uint64_t now = get_time_ns();
+	int64_t d = now - impl->capture_arrival - impl->capture_duration;
+	bool restart = true;
+
+	if (impl->capture_arrival != 0 &&
+	    now - impl->capture_arrival < JITTER_RESET_MSEC * SPA_NSEC_PER_MSEC) {
+		impl->capture_jitter_ns += (fabsf((float)d) - impl->capture_jitter_ns) / 16.0f;
+		SPA_ATOMIC_STORE(impl->capture_jitter, (uint32_t)impl->capture_jitter_ns);
+		restart = false;
+	}
+	impl->capture_arrival = now;
+	impl->capture_duration = (uint64_t)frames * SPA_NSEC_PER_SEC /
+		SPA_ATOMIC_LOAD(impl->capture_rate);
+
+	impl->host_clock = timestamp + frames;
+	if (impl->driver)
+		update_host_rate(impl, now, restart);
+}
+
+/* receive len bytes of capture audio into the ring, drop what does not fit */
+static int recv_capture(struct impl *impl, uint32_t len)
+{
+	uint32_t frame_size = SPA_ATOMIC_LOAD(impl->capture_frame_size);
+	uint32_t index, avail, size;
+	struct iovec iov[2];
+	int res;
+
+	if (SPA_ATOMIC_LOAD(impl->shm_active)) {
+		/* the host writes the shared ring, never race it */
+		return recv_discard(impl, len);
+	}
+
+	capture_arrival(impl, impl->capture_timestamp, len / frame_size);
+
+	avail = ring_free(&impl->capture, &index);
+	size = SPA_ROUND_DOWN(SPA_MIN(avail, len), frame_size);
+
+	if (size > 0) {
+		if ((res = recv_iov(impl, iov,
+				ring_iov(&impl->capture, index, size, iov))) < 0)
+			return res;
+		spa_ringbuffer_write_update(impl->capture.rb, index + size);
+		driver_check(impl, false);
+	}
+	if (size < len) {
+		// The reader owns the read index, drop what did not fit
+		rt_message(impl, RT_MSG_CAPTURE_OVERRUN, len - size);
+		SPA_ATOMIC_INC(impl->capture_overruns);
+		return recv_discard(impl, len - size);
+	}
+	return 0;
+}
+
+/* the decoder set up for the last HELLO, taken over by the receive thread */
+static struct codec_decoder *capture_decoder(struct impl *impl)
+{
+	struct codec_decoder *decoder = SPA_ATOMIC_XCHG(impl->decoder_pending, NULL);
+
+	if (decoder != NULL) {
+		codec_decoder_free(impl->decoder);
+		impl->decoder = decoder;
+	}
+	return impl->decoder;
+}
+
+/* decode one Opus packet into the capture ring */
+static int recv_encoded(struct impl *impl, uint32_t len)
+{
+	uint32_t frame_size = SPA_ATOMIC_LOAD(impl->capture_frame_size);
+	uint32_t index, avail, size;
+	struct iovec iov;
+	int res;
+
+	if (len > sizeof(impl->decoder_data) || SPA_ATOMIC_LOAD(impl->shm_active))
+		return recv_discard(impl, len);
+
+	iov.iov_base = impl->decoder_data;
+	iov.iov_len = len;
+	if ((res = recv_iov(impl, &iov, 1)) < 0)
+		return res;
+
+	res = codec_decode(impl->decoder, impl->decoder_data, len, impl->decoder_pcm,
+			LINDROID_CODEC_MAX_DECODE);
+	if (res < 0) {
+		rt_message(impl, RT_MSG_DECODE_FAILED, -res);
+		SPA_ATOMIC_INC(impl->capture_lost);
+		return 0;
+	}
+
+	capture_arrival(impl, impl->capture_timestamp, res);
+
+	avail = ring_free(&impl->capture, &index);
+	size = res * frame_size;
+	if (size > avail) {
+		rt_message(impl, RT_MSG_CAPTURE_OVERRUN, size - avail);
+		SPA_ATOMIC_INC(impl->capture_overruns);
+		size = SPA_ROUND_DOWN(avail, frame_size);
+	}
+	if (size > 0) {
+		spa_ringbuffer_write_data(impl->capture.rb, impl->capture.data,
+				impl->capture.size, index & impl->capture.mask,
+				impl->decoder_pcm, size);
+		spa_ringbuffer_write_update(impl->capture.rb, index + size);
+		driver_check(impl, false);
+	}
+	return 0;
+}
+
+static void set_protocol(struct impl *impl, enum protocol protocol)
+{
+	SPA_ATOMIC_STORE(impl->protocol, protocol);
+	/* let the io thread send what was held back */
+	pw_loop_signal_event(impl->io_loop, impl->playback_event);
+}
+
+static inline uint32_t playback_frame_size(struct playback_stream *pb)
+{
+	return sample_size(pb->info.format) * pb->info.channels;
+}
+
+static void update_high_water(struct playback_stream *pb)
+{
+	struct impl *impl = pb->impl;
+	uint32_t frame_size = playback_frame_size(pb);
+
+	pb->high_water = SPA_MIN((uint64_t)impl->high_water_msec * pb->info.rate / 1000,
+			pb->ring.size / frame_size) * frame_size;
+	if (pb->id == 0 && impl->shm)
+		impl->shm->playback.high_water = pb->high_water;
+}
+
+static void reset_rate_match(struct impl *impl)
+{
+	struct playback_stream *pb;
+	uint32_t i;
+
+	for (i = 0; i < impl->n_playbacks; i++) {
+		pb = &impl->playbacks[i];
+		pb->target = (uint64_t)impl->playback_target_msec * pb->info.rate / 1000;
+		spa_dll_init(&pb->dll);
+		spa_dll_set_bw(&pb->dll, SPA_DLL_BW_MIN, DLL_PERIOD, pb->info.rate);
+	}
+
+	impl->capture_base_target = (uint64_t)impl->capture_target_msec *
+		impl->source_info.rate / 1000;
+	SPA_ATOMIC_STORE(impl->capture_target, impl->capture_base_target);
+	impl->capture_max = (uint64_t)impl->capture_max_msec * impl->source_info.rate / 1000;
+	spa_dll_init(&impl->capture_dll);
+	spa_dll_set_bw(&impl->capture_dll, SPA_DLL_BW_MIN, DLL_PERIOD, impl->source_info.rate);
+}
+
+static void publish_capture_format(struct impl *impl)
+{
+	SPA_ATOMIC_STORE(impl->capture_format, format_to_lindroid(impl->source_info.format));
+	SPA_ATOMIC_STORE(impl->capture_frame_size,
+			sample_size(impl->source_info.format) * impl->source_info.channels);
+	SPA_ATOMIC_STORE(impl->capture_rate, impl->source_info.rate);
+}
+
+static bool can_convert(struct impl *impl, const struct spa_audio_info_raw *info)
+{
+	return impl->convert && info->format == SPA_AUDIO_FORMAT_S16_LE;
+}
+
+static const struct spa_pod *build_stream_format(struct impl *impl, struct spa_pod_builder *b,
+		const struct spa_audio_info_raw *info)
+{
+	struct spa_audio_info_raw stream_info = *info;
+
+	if (can_convert(impl, info))
+		stream_info.format = SPA_AUDIO_FORMAT_F32P;
+
+	return spa_format_audio_raw_build(b, SPA_PARAM_EnumFormat, &stream_info);
+}
+
+static void update_stream_format(struct impl *impl, struct pw_stream *stream,
+		const struct spa_audio_info_raw *info)
+{
+	const struct spa_pod *params[1];
+	uint8_t buffer[1024];
+	struct spa_pod_builder b;
+
+	if (stream == NULL)
+		return;
+
+	spa_pod_builder_init(&b, buffer, sizeof(buffer));
+	params[0] = build_stream_format(impl, &b, info);
+	pw_stream_update_params(stream, params, 1);
+}
+
+/* the reference replays the ring of stream 0 as it is, in its format */
+static void update_reference_format(struct impl *impl)
+{
+	const struct spa_pod *params[1];
+	uint8_t buffer[1024];
+	struct spa_pod_builder b;
+
+	if (impl->aec_stream == NULL)
+		return;
+
+	spa_pod_builder_init(&b, buffer, sizeof(buffer));
+	params[0] = spa_format_audio_raw_build(&b, SPA_PARAM_EnumFormat,
+			&impl->playbacks[0].info);
+	pw_stream_update_params(impl->aec_stream, params, 1);
+}
+
+/* adopt the rate and sample format the host answered with, the channel
+ * layout is ours to pick */
+static bool format_from_host(struct spa_audio_info_raw *info,
+		const struct lindroid_format_info *fi, const char *direction)
+{
+	uint32_t format = format_from_lindroid(fi->format);
+
+	if (format == info->format && fi->rate == info->rate &&
+	    fi->channels == info->channels)
+		return false;
+
+	if (format == SPA_AUDIO_FORMAT_UNKNOWN || fi->rate == 0 ||
+	    fi->rate > MAX_HOST_RATE || fi->channels != info->channels) {
+		pw_log_warn("ignoring %s format %u/%u/%u from host", direction,
+				fi->format, fi->rate, fi->channels);
+		return false;
+	}
+
+	pw_log_info("host asked for %s format %s %uHz", direction,
+			spa_debug_type_find_short_name(spa_type_audio_format, format),
+			fi->rate);
+	info->format = format;
+	info->rate = fi->rate;
+	return true;
+}
+
+static bool codec_takes(const struct spa_audio_info_raw *info)
+{
+	return info->format == SPA_AUDIO_FORMAT_S16_LE &&
+		codec_supported(info->rate, info->channels);
+}
+
+static void free_encoders(struct impl *impl)
+{
+	uint32_t i;
+
+	for (i = 0; i < impl->n_playbacks; i++) {
+		codec_encoder_free(impl->playbacks[i].encoder);
+		impl->playbacks[i].encoder = NULL;
+	}
+}
+
+/* runs in the io thread, which owns the encoders */
+static int do_setup_encoders(struct spa_loop *loop, bool async, uint32_t seq,
+		const void *data, size_t size, void *user_data)
+{
+	struct impl *impl = user_data;
+	struct playback_stream *pb;
+	const char *role;
+	uint32_t i;
+
+	free_encoders(impl);
+
+	if (!SPA_ATOMIC_LOAD(impl->codec_active))
+		return 0;
+
+	for (i = 0; i < impl->n_playbacks; i++) {
+		pb = &impl->playbacks[i];
+		if (!codec_takes(&pb->info)) {
+			pw_log_info("sending playback stream %u as PCM", pb->id);
+			continue;
+		}
+		role = pw_properties_get(pb->props, PW_KEY_MEDIA_ROLE);
+		pb->encoder = codec_encoder_new(pb->info.rate, pb->info.channels,
+				impl->codec_bitrate, spa_streq(role, "Communication"));
+		if (pb->encoder == NULL)
+			pw_log_warn("can't create encoder for playback stream %u: %m",
+					pb->id);
+	}
+	return 0;
+}
+
+/* while disconnected the RT process keeps writing, throw it away so the
+ * host starts from fresh audio when it comes back. Also what was queued in
+ * a format the host no longer takes. */
+static void discard_playback(struct impl *impl)
+{
+	uint32_t i, index;
+	int32_t avail;
+
+	for (i = 0; i < impl->n_playbacks; i++) {
+		struct playback_stream *pb = &impl->playbacks[i];
+
+		avail = spa_ringbuffer_get_read_index(pb->ring.rb, &index);
+		if (avail <= 0)
+			continue;
+		spa_ringbuffer_read_update(pb->ring.rb, index + avail);
+		pb->position += avail / playback_frame_size(pb);
+	}
+}
+
+/* runs in the io thread once the format is applied. What the streams queued
+ * before may be in the old format and goes, then audio flows. */
+static int do_start_framed(struct spa_loop *loop, bool async, uint32_t seq,
+		const void *data, size_t size, void *user_data)
+{
+	struct impl *impl = user_data;
+
+	do_setup_encoders(loop, async, seq, data, size, user_data);
+	discard_playback(impl);
+	set_protocol(impl, PROTOCOL_FRAMED);
+	return 0;
+}
+
+/* the host compresses capture in the format it asked for, which is only
+ * ours when format_from_host took it */
+static void setup_decoder(struct impl *impl, const struct lindroid_format_info *fi)
+{
+	struct spa_audio_info_raw *info = &impl->source_info;
+	struct codec_decoder *decoder = NULL;
+
+	if (SPA_ATOMIC_LOAD(impl->codec_active) &&
+	    format_from_lindroid(fi->format) == info->format &&
+	    fi->rate == info->rate && fi->channels == info->channels &&
+	    codec_takes(info)) {
+		decoder = codec_decoder_new(info->rate, info->channels);
+		if (decoder == NULL)
+			pw_log_warn("can't create capture decoder: %m");
+	}
+	codec_decoder_free(SPA_ATOMIC_XCHG(impl->decoder_pending, decoder));
+}
+
+struct format_update {
+	struct spa_audio_info_raw playback;
+	struct spa_audio_info_raw capture;
+};
+
+/* runs in the data loop, where the process callbacks read the formats, the
+ * high water and the rate match. The capture ring is ours to flush: the
+ * receive thread drops capture until the protocol is framed and the host
+ * only gets the shared memory after that. */
+static int do_apply_format(struct spa_loop *loop, bool async, uint32_t seq,
+		const void *data, size_t size, void *user_data)
+{
+	struct impl *impl = user_data;
+	const struct format_update *u = data;
+	struct playback_stream *pb = &impl->playbacks[0];
+	uint32_t frame_size = SPA_ATOMIC_LOAD(impl->capture_frame_size);
+	uint32_t index;
+
+	pb->info = u->playback;
+	update_high_water(pb);
+
+	impl->source_info = u->capture;
+	publish_capture_format(impl);
+	if (SPA_ATOMIC_LOAD(impl->capture_frame_size) != frame_size) {
+		spa_ringbuffer_get_write_index(impl->capture.rb, &index);
+		spa_ringbuffer_read_update(impl->capture.rb, index);
+	}
+
+	/* on a reconnect the streams are still running, the DLLs restart
+	 * with the new rates */
+	reset_rate_match(impl);
+	return 0;
+}
+
+static int do_update_format(struct spa_loop *loop, bool async, uint32_t seq,
+		const void *data, size_t size, void *user_data)
+{
+	struct impl *impl = user_data;
+	const struct lindroid_hello *hello = data;
+	struct playback_stream *pb = &impl->playbacks[0];
+	struct format_update u;
+	bool playback_changed, capture_changed;
+
+	u.playback = pb->info;
+	u.capture = impl->source_info;
+	playback_changed = format_from_host(&u.playback, &hello->playback, "playback");
+	capture_changed = format_from_host(&u.capture, &hello->capture, "capture");
+
+	pw_loop_invoke(impl->data_loop, do_apply_format, 0, &u, sizeof(u), true, impl);
+
+	if (playback_changed) {
+		update_stream_format(impl, pb->stream, &pb->info);
+		update_reference_format(impl);
+	}
+	if (capture_changed)
+		update_stream_format(impl, impl->source_stream, &impl->source_info);
+
+	setup_decoder(impl, &hello->capture);
+
+	/* audio only flows once both sides agree, packets tell their format */
+	pw_loop_invoke(impl->io_loop, do_start_framed, 0, NULL, 0, false, impl);
+	return 0;
+}
+
+static void handle_hello(struct impl *impl, const struct lindroid_hello *hello)
+{
+	pw_log_info("host speaks protocol version %u, flags 0x%08x",
+			hello->version, hello->flags);
+
+	if ((hello->flags & LINDROID_HELLO_FLAG_SHM) && impl->shm_fd >= 0) {
+		pw_log_info("host accepted the shared memory transport");
+		SPA_ATOMIC_STORE(impl->shm_pending, true);
+	}
+	if (impl->low_latency)
+		pw_log_info("host %s a low latency path",
+				(hello->flags & LINDROID_HELLO_FLAG_LOW_LATENCY) ?
+				"opened" : "could not open");
+
+	/* a second HELLO renegotiates, hold the audio until it is applied */
+	SPA_ATOMIC_CAS(impl->protocol, PROTOCOL_FRAMED, PROTOCOL_HANDSHAKE);
+
+	codec_decoder_free(impl->decoder);
+	impl->decoder = NULL;
+	if (impl->codec_offer && (hello->flags & LINDROID_HELLO_FLAG_OPUS)) {
+		pw_log_info("host accepted Opus compression");
+		SPA_ATOMIC_STORE(impl->codec_active, true);
+	}
+
+	pw_loop_invoke(impl->main_loop, do_update_format, 0,
+			hello, sizeof(*hello), false, impl);
+}
+
+static void handle_latency(struct impl *impl, uint8_t stream,
+		const struct lindroid_latency *latency)
+{
+	struct playback_stream *pb;
+
+	if (latency->direction == LINDROID_PACKET_PLAYBACK && stream < impl->n_playbacks) {
+		pb = &impl->playbacks[stream];
+		SPA_ATOMIC_STORE(pb->host_buffered, latency->buffered);
+		SPA_ATOMIC_STORE(pb->host_device, latency->device);
+	} else if (latency->direction == LINDROID_PACKET_CAPTURE && stream == 0) {
+		SPA_ATOMIC_STORE(impl->capture_host_buffered, latency->buffered);
+		SPA_ATOMIC_STORE(impl->capture_host_device, latency->device);
+	} else {
+		pw_log_debug("ignoring latency for direction %u stream %u",
+				latency->direction, stream);
+	}
+}
+
+static int receive_payload(struct impl *impl, const struct lindroid_header *hdr)
+{
+	struct lindroid_hello hello;
+	struct lindroid_latency latency;
+	struct iovec iov;
+	uint32_t len;
+	int res;
+
+	switch (hdr->type) {
+	case LINDROID_PACKET_HELLO:
+		spa_zero(hello);
+		len = SPA_MIN(hdr->length, sizeof(hello));
+		iov.iov_base = &hello;
+		iov.iov_len = len;
+		if ((res = recv_iov(impl, &iov, 1)) < 0 ||
+		    (res = recv_discard(impl, hdr->length - len)) < 0)
+			return res;
+		handle_hello(impl, &hello);
+		return 0;
+
+	case LINDROID_PACKET_CAPTURE:
+		/* until the host format is applied the ring is not ours to
+		 * write, see do_apply_format */
+		if (hdr->stream != 0 ||
+		    SPA_ATOMIC_LOAD(impl->protocol) != PROTOCOL_FRAMED)
+			break;
+		if (hdr->format != SPA_ATOMIC_LOAD(impl->capture_format) &&
+		    (hdr->format != LINDROID_FORMAT_OPUS || capture_decoder(impl) == NULL))
+			break;
+
+		if (impl->capture_seq_valid && hdr->seq != impl->capture_seq + 1) {
+			rt_message(impl, RT_MSG_CAPTURE_LOST, hdr->seq - impl->capture_seq - 1);
+			SPA_ATOMIC_INC(impl->capture_lost);
+		}
+		impl->capture_seq = hdr->seq;
+		impl->capture_seq_valid = true;
+		impl->capture_timestamp = hdr->timestamp;
+
+		if (hdr->format == LINDROID_FORMAT_OPUS)
+			return recv_encoded(impl, hdr->length);
+		return recv_capture(impl, hdr->length);
+
+	case LINDROID_PACKET_LATENCY:
+		spa_zero(latency);
+		len = SPA_MIN(hdr->length, sizeof(latency));
+		iov.iov_base = &latency;
+		iov.iov_len = len;
+		if ((res = recv_iov(impl, &iov, 1)) < 0 ||
+		    (res = recv_discard(impl, hdr->length - len)) < 0)
+			return res;
+		handle_latency(impl, hdr->stream, &latency);
+		return 0;
+
+	default:
+		break;
+	}
+
+	rt_message(impl, RT_MSG_IGNORED_PACKET, hdr->length);
+	return recv_discard(impl, hdr->length);
+}
+
+/* the payload is timed, waiting for the header is not */
+static int receive_framed(struct impl *impl)
+{
+	struct lindroid_header hdr;
+	uint32_t resyncs = 0;
+	uint64_t start;
+	int res;
+
+	res = packet_reader_header(&impl->recv, impl->audio_socket_fd, &hdr,
+			impl->capture.size, &resyncs);
+	if (resyncs > 0)
+		SPA_ATOMIC_STORE(impl->capture_resyncs, impl->capture_resyncs + resyncs);
+	if (res < 0)
+		return res;
+
+	start = get_time_ns();
+	res = receive_payload(impl, &hdr);
+	transport_stats_add(&impl->recv_stats, sizeof(hdr) + hdr.length, 1,
+			get_time_ns() - start);
+	return res;
+}
+
+static int receive_legacy(struct impl *impl)
+{
+	uint8_t prefix, discard[LINDROID_MAX_PACKET_SIZE - 1];
+	struct iovec iov[4];
+	struct msghdr msg;
+	ssize_t bytesRead;
+	uint32_t index, avail, size;
+	int n_iov;
+
+	if (packet_reader_buffered(&impl->recv) > 0) {
+		/* legacy hosts rely on the packet boundaries of their writes,
+		 * which a read ahead loses */
+		pw_log_debug("dropping %u bytes of read ahead",
+				packet_reader_buffered(&impl->recv));
+		packet_reader_reset(&impl->recv);
+	}
+
+	avail = SPA_MIN(ring_free(&impl->capture, &index), LINDROID_MAX_PACKET_SIZE - 1);
+
+	// Receive the payload straight into the free part of the ring,
+	// whatever does not fit lands in the discard buffer
+	iov[0].iov_base = &prefix;
+	iov[0].iov_len = 1;
+	n_iov = 1;
+	if (avail > 0)
+		n_iov += ring_iov(&impl->capture, index, avail, &iov[n_iov]);
+	iov[n_iov].iov_base = discard;
+	iov[n_iov].iov_len = sizeof(discard) - avail;
+	n_iov++;
+
+	spa_zero(msg);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = n_iov;
+
+	bytesRead = recvmsg(impl->audio_socket_fd, &msg, 0);
+	if (bytesRead < 0)
+		return -errno;
+	if (bytesRead == 0)
+		return -EPIPE;
+
+	// Check if the packet starts with 0x02
+	if (prefix != AUDIO_INPUT_PREFIX) {
+		rt_message(impl, RT_MSG_INVALID_PREFIX, bytesRead);
+		return 0;
+	}
+
+	/* the only recvmsg also waits for the host, so no time is counted */
+	transport_stats_add(&impl->recv_stats, bytesRead, 1, 0);
+	/* no timestamps, the host clock is what it sent */
+	capture_arrival(impl, impl->host_clock, (bytesRead - 1) /
+			SPA_ATOMIC_LOAD(impl->capture_frame_size));
+
+	size = bytesRead - 1;
+	if (size > avail) {
+		// The reader owns the read index, drop what did not fit
+		rt_message(impl, RT_MSG_CAPTURE_OVERRUN, size - avail);
+		SPA_ATOMIC_INC(impl->capture_overruns);
+		size = avail;
+	}
+
+	spa_ringbuffer_write_update(impl->capture.rb, index + size);
+	driver_check(impl, false);
+	return 0;
+}
+
+static int receive_packet(struct impl *impl)
+{
+	uint8_t first;
+	ssize_t res;
+
+	switch (SPA_ATOMIC_LOAD(impl->protocol)) {
+	case PROTOCOL_FRAMED:
+		return receive_framed(impl);
+	case PROTOCOL_LEGACY:
+		if (impl->protocol_config == PROTOCOL_LEGACY)
+			return receive_legacy(impl);
+		break;
+	default:
+		break;
+	}
+
+	/* still negotiating, the first byte tells the protocols apart */
+	if (packet_reader_buffered(&impl->recv) > 0) {
+		first = impl->recv.buf[impl->recv.offset];
+	} else {
+		res = recv(impl->audio_socket_fd, &first, 1, MSG_PEEK);
+		if (res < 0)
+			return -errno;
+		if (res == 0)
+			return -EPIPE;
+	}
+
+	if (first == LINDROID_PROTOCOL_MAGIC)
+		return receive_framed(impl);
+
+	if (first == AUDIO_INPUT_PREFIX && impl->protocol_config == PROTOCOL_AUTO) {
+		if (SPA_ATOMIC_LOAD(impl->protocol) == PROTOCOL_HANDSHAKE) {
+			pw_log_info("host uses the legacy protocol");
+			set_protocol(impl, PROTOCOL_LEGACY);
+		}
+		return receive_legacy(impl);
+	}
+
+	rt_message(impl, RT_MSG_UNEXPECTED_BYTE, 1);
+	return recv_discard(impl, 1);
+}
+
+static void* socket_receive_thread(void* arg) {
+	struct impl *impl = (struct impl*)arg;
+	int res;
+
+	while ((res = receive_packet(impl)) >= 0);
+
+	if (res == -EPIPE)
+		pw_log_info("audio socket closed by host");
+	else
+		pw_log_error("Failed to receive audio data: %s", spa_strerror(res));
+
+	/* hand the teardown to the io thread */
+	SPA_ATOMIC_STORE(impl->receive_failed, true);
+	pw_loop_signal_event(impl->io_loop, impl->disconnect_event);
+	return NULL;
+}
+
+static void update_socket_mask(struct impl *impl, uint32_t mask)
+{
+	if (impl->socket_source == NULL || impl->socket_mask == mask)
+		return;
+
+	impl->socket_mask = mask;
+	pw_loop_update_io(impl->io_loop, impl->socket_source, mask);
+}
+
+static void prepare_header(struct impl *impl, uint8_t type, uint8_t stream,
+		uint32_t format, uint32_t seq, uint64_t timestamp, uint32_t length)
+{
+	packet_writer_prepare(&impl->send, type, stream, format, seq, timestamp, length);
+}
+
+static void prepare_stream_info(struct impl *impl, struct playback_stream *pb)
+{
+	struct lindroid_stream_info *info = &impl->send_stream_info;
+	const char *str;
+
+	spa_zero(*info);
+	format_info_from_raw(&info->format, &pb->info);
+	if ((str = pw_properties_get(pb->props, PW_KEY_NODE_NAME)) != NULL)
+		snprintf(info->name, sizeof(info->name), "%s", str);
+	if ((str = pw_properties_get(pb->props, PW_KEY_MEDIA_ROLE)) != NULL)
+		snprintf(info->role, sizeof(info->role), "%s", str);
+
+	prepare_header(impl, LINDROID_PACKET_STREAM, pb->id, LINDROID_FORMAT_UNKNOWN,
+			0, 0, sizeof(*info));
+	impl->send.data = info;
+}
+
+/* compress one codec frame from the ring, false while it has less */
+static bool prepare_encoded(struct impl *impl, struct playback_stream *pb,
+		uint32_t index, uint32_t avail)
+{
+	uint32_t n_frames = pb->info.rate * LINDROID_CODEC_FRAME_MSEC / 1000;
+	uint32_t size = n_frames * playback_frame_size(pb);
+	int res;
+
+	if (avail < size)
+		return false;
+
+	spa_ringbuffer_read_data(pb->ring.rb, pb->ring.data, pb->ring.size,
+			index & pb->ring.mask, impl->codec_pcm, size);
+	spa_ringbuffer_read_update(pb->ring.rb, index + size);
+
+	res = codec_encode(pb->encoder, impl->codec_pcm, n_frames,
+			impl->codec_data, sizeof(impl->codec_data));
+	if (res < 0) {
+		rt_message(impl, RT_MSG_ENCODE_FAILED, -res);
+		pb->position += n_frames;
+		return false;
+	}
+
+	prepare_header(impl, LINDROID_PACKET_PLAYBACK, pb->id, LINDROID_FORMAT_OPUS,
+			pb->seq++, pb->position, res);
+	impl->send.data = impl->codec_data;
+	impl->send_audio = pb;
+	impl->send_frames = n_frames;
+	pb->position += n_frames;
+	return true;
+}
+
+/* queue an audio packet from one stream, false when it has nothing */
+static bool prepare_audio(struct impl *impl, struct playback_stream *pb,
+		enum protocol protocol)
+{
+	uint32_t frame_size = playback_frame_size(pb);
+	uint32_t index, skip, size;
+	int32_t avail;
+
+	/* the host reads the shared ring itself */
+	if (pb->id == 0 && SPA_ATOMIC_LOAD(impl->shm_active))
+		return false;
+
+	avail = spa_ringbuffer_get_read_index(pb->ring.rb, &index);
+	if (avail <= 0)
+		return false;
+
+	if (protocol == PROTOCOL_HANDSHAKE ||
+	    (protocol == PROTOCOL_LEGACY && pb->id != 0)) {
+		/* no audio before the host told us what it accepts, and
+		 * legacy hosts only know one stream */
+		spa_ringbuffer_read_update(pb->ring.rb, index + avail);
+		pb->position += avail / frame_size;
+		return false;
+	}
+
+	if (impl->drop_policy == DROP_POLICY_OLDEST &&
+	    (uint32_t)avail > pb->high_water) {
+		skip = avail - pb->high_water;
+		rt_message(impl, RT_MSG_PLAYBACK_SKIP, skip);
+		SPA_ATOMIC_INC(pb->drops);
+		index += skip;
+		avail -= skip;
+		pb->position += skip / frame_size;
+		spa_ringbuffer_read_update(pb->ring.rb, index);
+	}
+
+	if (pb->encoder != NULL && protocol == PROTOCOL_FRAMED)
+		return prepare_encoded(impl, pb, index, avail);
+
+	if (protocol == PROTOCOL_LEGACY) {
+		size = SPA_MIN((uint32_t)avail, LINDROID_MAX_PACKET_SIZE - 1);
+		impl->send.header[0] = AUDIO_OUTPUT_PREFIX;
+		impl->send.header_size = 1;
+		impl->send.offset = 0;
+		impl->send.size = size + 1;
+	} else {
+		size = SPA_MIN((uint32_t)avail, SPA_ROUND_DOWN(LINDROID_MAX_PACKET_SIZE -
+					sizeof(struct lindroid_header), frame_size));
+		prepare_header(impl, LINDROID_PACKET_PLAYBACK, pb->id,
+				format_to_lindroid(pb->info.format),
+				pb->seq++, pb->position, size);
+	}
+	impl->send.data = NULL;
+	impl->send_stream = pb;
+	impl->send.ring = &pb->ring;
+	impl->send.index = index;
+	impl->send_audio = pb;
+	impl->send_frames = size / frame_size;
+	pb->position += size / frame_size;
+
+	return true;
+}
+
+static void disconnect(struct impl *impl);
+
+/* tell the host about streams that went idle or came back */
+static bool prepare_state(struct impl *impl)
+{
+	struct lindroid_state *state = &impl->send_state;
+	struct playback_stream *pb;
+	uint32_t i, stream = 0;
+	bool suspended;
+
+	for (i = 0; i < impl->n_playbacks; i++) {
+		pb = &impl->playbacks[i];
+		suspended = SPA_ATOMIC_LOAD(pb->paused) || SPA_ATOMIC_LOAD(pb->silent);
+		if (suspended != pb->host_suspended) {
+			pb->host_suspended = suspended;
+			state->direction = LINDROID_PACKET_PLAYBACK;
+			stream = pb->id;
+			goto found;
+		}
+	}
+	suspended = SPA_ATOMIC_LOAD(impl->capture_paused);
+	if (suspended != impl->capture_host_suspended) {
+		impl->capture_host_suspended = suspended;
+		state->direction = LINDROID_PACKET_CAPTURE;
+		goto found;
+	}
+	return false;
+
+found:
+	pw_log_debug("%s %s stream %u", suspended ? "suspending" : "resuming",
+			state->direction == LINDROID_PACKET_PLAYBACK ? "playback" : "capture",
+			stream);
+	state->state = suspended ? LINDROID_STATE_SUSPENDED : LINDROID_STATE_RUNNING;
+	prepare_header(impl, LINDROID_PACKET_STATE, stream, LINDROID_FORMAT_UNKNOWN,
+			0, 0, sizeof(*state));
+	impl->send.data = state;
+	return true;
+}
+
+/* pick the next packet to send, false when there is nothing to do */
+static bool prepare_packet(struct impl *impl)
+{
+	enum protocol protocol = SPA_ATOMIC_LOAD(impl->protocol);
+	uint32_t i, n;
+
+	impl->send_stream = NULL;
+	impl->send_audio = NULL;
+
+	if (impl->hello_pending) {
+		struct lindroid_hello *hello = &impl->send_hello;
+
+		spa_zero(*hello);
+		hello->version = LINDROID_PROTOCOL_VERSION;
+		if (impl->shm_fd >= 0)
+			hello->flags |= LINDROID_HELLO_FLAG_SHM;
+		if (impl->low_latency)
+			hello->flags |= LINDROID_HELLO_FLAG_LOW_LATENCY;
+		if (impl->codec_offer)
+			hello->flags |= LINDROID_HELLO_FLAG_OPUS;
+		format_info_from_raw(&hello->playback, &impl->playbacks[0].info);
+		format_info_from_raw(&hello->capture, &impl->source_info);
+
+		prepare_header(impl, LINDROID_PACKET_HELLO, 0, LINDROID_FORMAT_UNKNOWN,
+				0, 0, sizeof(*hello));
+		impl->send.data = hello;
+		impl->hello_pending = false;
+		/* the other streams are announced right after */
+		impl->stream_info_pending = ((1u << impl->n_playbacks) - 1) & ~1u;
+		return true;
+	}
+
+	if (impl->stream_info_pending) {
+		i = __builtin_ctz(impl->stream_info_pending);
+		impl->stream_info_pending &= ~(1u << i);
+		prepare_stream_info(impl, &impl->playbacks[i]);
+		return true;
+	}
+
+	/* not before the format is applied, the capture ring may be flushed */
+	if (protocol == PROTOCOL_FRAMED && SPA_ATOMIC_LOAD(impl->shm_pending)) {
+		impl->send_shm.size = impl->shm_size;
+		impl->send_shm.flags = 0;
+
+		prepare_header(impl, LINDROID_PACKET_SHM, 0, LINDROID_FORMAT_UNKNOWN,
+				0, 0, sizeof(impl->send_shm));
+		impl->send.data = &impl->send_shm;
+		impl->send.fds[0] = impl->shm_fd;
+		impl->send.fds[1] = impl->shm_eventfd;
+		impl->send.n_fds = 2;
+		SPA_ATOMIC_STORE(impl->shm_pending, false);
+		return true;
+	}
+
+	/* a resume goes out before the audio that caused it */
+	if (protocol == PROTOCOL_FRAMED && prepare_state(impl))
+		return true;
+
+	for (n = 0; n < impl->n_playbacks; n++) {
+		i = (impl->next_playback + n) % impl->n_playbacks;
+		if (prepare_audio(impl, &impl->playbacks[i], protocol)) {
+			impl->next_playback = i + 1;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void inflight_pop(struct impl *impl)
+{
+	struct inflight *f = &impl->inflight[impl->inflight_head];
+
+	SPA_ATOMIC_STORE(f->pb->socket_queued, f->pb->socket_queued - f->frames);
+	impl->inflight_head = (impl->inflight_head + 1) % MAX_INFLIGHT;
+	impl->n_inflight--;
+}
+
+static void inflight_push(struct impl *impl, struct playback_stream *pb, uint32_t frames)
+{
+	struct inflight *f;
+
+	if (impl->n_inflight == MAX_INFLIGHT) {
+		if (!impl->inflight_full)
+			pw_log_warn("more than %u audio packets in the socket, "
+					"merging their accounting", MAX_INFLIGHT);
+		impl->inflight_full = true;
+
+		/* the frames retire with the newest packet of their stream,
+		 * somewhat late, better than never counted */
+		f = &impl->inflight[(impl->inflight_head + impl->n_inflight - 1) % MAX_INFLIGHT];
+		if (f->pb == pb) {
+			f->end = impl->sent_truesize;
+			f->frames += frames;
+			SPA_ATOMIC_STORE(pb->socket_queued, pb->socket_queued + frames);
+			return;
+		}
+		/* otherwise the oldest goes, it is the closest to being read */
+		inflight_pop(impl);
+	}
+
+	f = &impl->inflight[(impl->inflight_head + impl->n_inflight++) % MAX_INFLIGHT];
+	f->pb = pb;
+	f->end = impl->sent_truesize;
+	f->frames = frames;
+	SPA_ATOMIC_STORE(pb->socket_queued, pb->socket_queued + frames);
+}
+
+/* SIOCOUTQ of a unix socket is the truesize of the skbs the host has not
+ * read yet, payload and allocation overhead, so the writes are counted the
+ * same way. The estimate is off by the slab rounding of the kernel the
+ * module runs on at most; an empty queue is exact. */
+static uint32_t skb_truesize(uint32_t len)
+{
+	uint32_t head = len, data = 0;
+
+	if (len > SKB_PAGE_SIZE - SKB_SHINFO_SIZE) {
+		data = SPA_MIN(len, SPA_ROUND_UP_N(len - (SKB_PAGE_SIZE - SKB_SHINFO_SIZE),
+					SKB_PAGE_SIZE));
+		head = len - data;
+	}
+	head += SKB_SHINFO_SIZE;
+	head = 1u << (32 - __builtin_clz(head - 1));
+
+	return SKB_STRUCT_SIZE + head + SPA_ROUND_UP_N(data, SKB_PAGE_SIZE);
+}
+
+/* retire the packets the host has read, the RT process only sees the
+ * per stream result and never touches the fd */
+static void sample_socket_queue(struct impl *impl)
+{
+	uint32_t consumed;
+	int outq;
+
+	if (ioctl(impl->audio_socket_fd, SIOCOUTQ, &outq) < 0)
+		outq = 0;
+	consumed = impl->sent_truesize - (uint32_t)SPA_MAX(outq, 0);
+
+	while (impl->n_inflight > 0 &&
+	    (int32_t)(impl->inflight[impl->inflight_head].end - consumed) <= 0)
+		inflight_pop(impl);
+}
+
+/* runs in the io thread, never blocks */
+static void flush_playback(struct impl *impl)
+{
+	struct packet_writer *w = &impl->send;
+	uint64_t start;
+	ssize_t sent;
+
+	while (impl->socket_source != NULL) {
+		if (packet_writer_done(w) && !prepare_packet(impl))
+			break;
+
+		start = get_time_ns();
+		sent = packet_writer_send(w, impl->audio_socket_fd);
+		transport_stats_add(&impl->send_stats, SPA_MAX(sent, 0),
+				sent > 0 && packet_writer_done(w), get_time_ns() - start);
+		if (sent == -EINTR)
+			continue;
+		if (sent == -EAGAIN) {
+			/* host is slow, continue when the socket drains */
+			update_socket_mask(impl, SPA_IO_OUT);
+			sample_socket_queue(impl);
+			return;
+		}
+		if (sent == -EPIPE || sent == -ECONNRESET || sent == -ENOTCONN) {
+			pw_log_info("audio socket closed by host");
+			disconnect(impl);
+			return;
+		}
+		if (sent < 0) {
+			rt_message(impl, RT_MSG_SEND_FAILED, -sent);
+			/* drop the rest of the packet */
+			w->offset = w->size;
+			w->n_fds = 0;
+		} else {
+			impl->sent_truesize += sent > 0 ? skb_truesize(sent) : 0;
+		}
+
+		if (!packet_writer_done(w))
+			continue;
+
+		if (impl->send_audio != NULL)
+			inflight_push(impl, impl->send_audio, impl->send_frames);
+
+		if (impl->send_stream != NULL)
+			spa_ringbuffer_read_update(impl->send_stream->ring.rb, w->index +
+					w->size - w->header_size);
+		else if (w->data == &impl->send_shm)
+			SPA_ATOMIC_STORE(impl->shm_active, true);
+	}
+	update_socket_mask(impl, 0);
+	sample_socket_queue(impl);
+}
+
+static void on_playback_event(void *data, uint64_t count)
+{
+	struct impl *impl = data;
+
+	if (impl->connected)
+		flush_playback(impl);
+	else
+		discard_playback(impl);
+}
+
+static void on_socket_io(void *data, int fd, uint32_t mask)
+{
+	struct impl *impl = data;
+
+	if (mask & (SPA_IO_ERR | SPA_IO_HUP)) {
+		pw_log_info("audio socket closed by host");
+		disconnect(impl);
+		return;
+	}
+	if (mask & SPA_IO_OUT)
+		flush_playback(impl);
+}
+
+static void on_handshake_timeout(void *data, uint64_t expirations)
+{
+	struct impl *impl = data;
+
+	if (SPA_ATOMIC_LOAD(impl->protocol) != PROTOCOL_HANDSHAKE)
+		return;
+
+	if (impl->protocol_config == PROTOCOL_FRAMED) {
+		pw_log_warn("host did not answer the handshake yet");
+		return;
+	}
+	pw_log_info("host did not answer the handshake, using the legacy protocol");
+	/* the HELLO may have arrived meanwhile, wake up the held back playback
+	 * only when the decision was ours */
+	if (SPA_ATOMIC_CAS(impl->protocol, PROTOCOL_HANDSHAKE, PROTOCOL_LEGACY))
+		pw_loop_signal_event(impl->io_loop, impl->playback_event);
+}
+
+static void on_driver_timeout(void *data, uint64_t expirations)
+{
+	struct impl *impl = data;
+	uint32_t cycles = SPA_ATOMIC_LOAD(impl->driver_cycles);
+	uint32_t timeout_msec = (uint64_t)DRIVER_TIMEOUT_QUANTA * driver_quantum(impl) *
+		1000 / SPA_ATOMIC_LOAD(impl->capture_rate);
+
+	if (cycles != impl->driver_seen_cycles) {
+		impl->driver_seen_cycles = cycles;
+		impl->driver_idle_msec = 0;
+	} else {
+		impl->driver_idle_msec += expirations * DRIVER_POLL_MSEC;
+	}
+
+	if (impl->driver_idle_msec >= timeout_msec) {
+		/* the host went quiet or a cycle got lost, keep the graph going */
+		impl->driver_idle_msec = 0;
+		SPA_ATOMIC_STORE(impl->driver_busy, false);
+		driver_check(impl, true);
+	} else {
+		/* the host writes the shared ring without telling us, and
+		 * more than a quantum may have piled up during a cycle */
+		driver_check(impl, false);
+	}
+}
+
+static int setup_driver_timer(struct impl *impl)
+{
+	struct timespec value;
+
+	impl->driver_timer = pw_loop_add_timer(impl->io_loop, on_driver_timeout, impl);
+	if (impl->driver_timer == NULL)
+		return -errno;
+
+	value.tv_sec = 0;
+	value.tv_nsec = DRIVER_POLL_MSEC * SPA_NSEC_PER_MSEC;
+	pw_loop_update_timer(impl->io_loop, impl->driver_timer, &value, &value, false);
+	return 0;
+}
+
+static int connect_audio_socket(struct impl *impl, bool verbose)
+{
+	struct sockaddr_un addr;
+	int res;
+
+	/* a full backlog fails with EAGAIN instead of blocking the io thread,
+	 * that is retried like a missing socket */
+	impl->audio_socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (impl->audio_socket_fd == -1) {
+		pw_log_error("Failed to create audio socket: %m");
+		return -errno;
+	}
+
+	if (impl->socket_sndbuf > 0 &&
+	    setsockopt(impl->audio_socket_fd, SOL_SOCKET, SO_SNDBUF,
+			    &impl->socket_sndbuf, sizeof(int)) < 0)
+		pw_log_warn("can't set the send buffer of the audio socket: %m");
+	if (impl->socket_rcvbuf > 0 &&
+	    setsockopt(impl->audio_socket_fd, SOL_SOCKET, SO_RCVBUF,
+			    &impl->socket_rcvbuf, sizeof(int)) < 0)
+		pw_log_warn("can't set the receive buffer of the audio socket: %m");
+
+	memset(&addr, 0, sizeof(struct sockaddr_un));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, impl->socket_path, sizeof(addr.sun_path) - 1);
+
+	if (connect(impl->audio_socket_fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)) == -1) {
+		res = -errno;
+		if (verbose)
+			pw_log_info("Failed to connect to audio socket %s: %m, will retry",
+					impl->socket_path);
+		else
+			pw_log_debug("Failed to connect to audio socket %s: %m",
+					impl->socket_path);
+		close(impl->audio_socket_fd);
+		impl->audio_socket_fd = -1;
+		return res;
+	}
+
+	/* the receive thread blocks, sends pass MSG_DONTWAIT */
+	if ((res = fcntl(impl->audio_socket_fd, F_GETFL)) < 0 ||
+	    fcntl(impl->audio_socket_fd, F_SETFL, res & ~O_NONBLOCK) < 0) {
+		res = -errno;
+		pw_log_error("Failed to set up audio socket: %m");
+		close(impl->audio_socket_fd);
+		impl->audio_socket_fd = -1;
+		return res;
+	}
+
+	return 0;
+}
+
+static void schedule_reconnect(struct impl *impl)
+{
+	struct timespec value;
+
+	if (impl->reconnect_msec == 0)
+		impl->reconnect_msec = RECONNECT_MIN_MSEC;
+	else
+		impl->reconnect_msec = SPA_MIN(impl->reconnect_msec * 2,
+				(uint32_t)RECONNECT_MAX_MSEC);
+
+	value.tv_sec = impl->reconnect_msec / SPA_MSEC_PER_SEC;
+	value.tv_nsec = (impl->reconnect_msec % SPA_MSEC_PER_SEC) * SPA_NSEC_PER_MSEC;
+	pw_loop_update_timer(impl->io_loop, impl->reconnect_timer, &value, NULL, false);
+}
+
+/* forget everything the last host was told, the next one starts over */
+static void reset_connection(struct impl *impl)
+{
+	uint32_t i;
+
+	impl->send_stream = NULL;
+	impl->send_audio = NULL;
+	impl->send.offset = impl->send.size = 0;
+	impl->sent_truesize = 0;
+	impl->inflight_head = impl->n_inflight = 0;
+	impl->inflight_full = false;
+	impl->send.n_fds = 0;
+	impl->socket_mask = 0;
+	impl->stream_info_pending = 0;
+	impl->next_playback = 0;
+	packet_reader_reset(&impl->recv);
+	impl->capture_seq_valid = false;
+	impl->capture_host_suspended = false;
+	impl->capture_arrival = 0;
+	impl->capture_jitter_ns = 0.0f;
+	/* a new host starts a new sample clock */
+	impl->host_clock = 0;
+	impl->host_clock_start_nsec = 0;
+	SPA_ATOMIC_STORE(impl->capture_jitter, 0);
+
+	SPA_ATOMIC_STORE(impl->shm_pending, false);
+	SPA_ATOMIC_STORE(impl->shm_active, false);
+
+	/* renegotiated with the next HELLO, the receive thread is gone */
+	SPA_ATOMIC_STORE(impl->codec_active, false);
+	free_encoders(impl);
+	codec_decoder_free(impl->decoder);
+	impl->decoder = NULL;
+	codec_decoder_free(SPA_ATOMIC_XCHG(impl->decoder_pending, NULL));
+
+	SPA_ATOMIC_STORE(impl->capture_host_buffered, 0);
+	SPA_ATOMIC_STORE(impl->capture_host_device, 0);
+	for (i = 0; i < impl->n_playbacks; i++) {
+		impl->playbacks[i].host_suspended = false;
+		SPA_ATOMIC_STORE(impl->playbacks[i].socket_queued, 0);
+		SPA_ATOMIC_STORE(impl->playbacks[i].host_buffered, 0);
+		SPA_ATOMIC_STORE(impl->playbacks[i].host_device, 0);
+	}
+
+	if (impl->protocol_config == PROTOCOL_LEGACY) {
+		SPA_ATOMIC_STORE(impl->protocol, PROTOCOL_LEGACY);
+		impl->hello_pending = false;
+	} else {
+		SPA_ATOMIC_STORE(impl->protocol, PROTOCOL_HANDSHAKE);
+		impl->hello_pending = true;
+	}
+}
+
+static void try_connect(struct impl *impl)
+{
+	static const struct spa_dict_item thread_items[] = {
+		{ SPA_KEY_THREAD_NAME, "lindroid-recv" },
+	};
+	struct timespec value;
+	int res;
+
+	if (impl->connected)
+		return;
+
+	if (connect_audio_socket(impl, impl->reconnect_msec == 0) < 0) {
+		schedule_reconnect(impl);
+		return;
+	}
+
+	/* the RT process may have left audio from before */
+	discard_playback(impl);
+	reset_connection(impl);
+
+	impl->socket_source = pw_loop_add_io(impl->io_loop, impl->audio_socket_fd,
+			0, false, on_socket_io, impl);
+	if (impl->socket_source == NULL) {
+		pw_log_error("can't watch the audio socket: %m");
+		goto error;
+	}
+
+	SPA_ATOMIC_STORE(impl->receive_failed, false);
+	impl->receive_thread = pw_thread_utils_create(&SPA_DICT_INIT_ARRAY(thread_items),
+			socket_receive_thread, impl);
+	if (impl->receive_thread == NULL) {
+		pw_log_error("Failed to create socket receive thread: %m");
+		goto error;
+	}
+	if ((res = pw_thread_utils_acquire_rt(impl->receive_thread, -1)) < 0)
+		pw_log_warn("no realtime priority for the receive thread: %s",
+				spa_strerror(res));
+	impl->connected = true;
+	impl->reconnect_msec = 0;
+	pw_log_info("connected to %s", impl->socket_path);
+
+	if (impl->hello_pending) {
+		value.tv_sec = HANDSHAKE_TIMEOUT_SEC;
+		value.tv_nsec = 0;
+		pw_loop_update_timer(impl->io_loop, impl->handshake_timer,
+				&value, NULL, false);
+	}
+
+	/* send the HELLO */
+	flush_playback(impl);
+	return;
+
+error:
+	if (impl->socket_source) {
+		pw_loop_destroy_source(impl->io_loop, impl->socket_source);
+		impl->socket_source = NULL;
+	}
+	close(impl->audio_socket_fd);
+	impl->audio_socket_fd = -1;
+	schedule_reconnect(impl);
+}
+
+static void close_connection(struct impl *impl)
+{
+	if (impl->receive_thread) {
+		/* wakes up the receive thread if it is still waiting */
+		shutdown(impl->audio_socket_fd, SHUT_RDWR);
+		pw_thread_utils_join(impl->receive_thread, NULL);
+		impl->receive_thread = NULL;
+	}
+	if (impl->socket_source) {
+		pw_loop_destroy_source(impl->io_loop, impl->socket_source);
+		impl->socket_source = NULL;
+	}
+	if (impl->audio_socket_fd >= 0) {
+		close(impl->audio_socket_fd);
+		impl->audio_socket_fd = -1;
+	}
+}
+
+static void disconnect(struct impl *impl)
+{
+	if (!impl->connected)
+		return;
+
+	impl->connected = false;
+	close_connection(impl);
+	/* the receive thread is gone, a stale event must not hit the next
+	 * connection */
+	SPA_ATOMIC_STORE(impl->receive_failed, false);
+
+	/* keep the streams running, the RT process goes back to dropping */
+	SPA_ATOMIC_STORE(impl->shm_active, false);
+	SPA_ATOMIC_STORE(impl->protocol, PROTOCOL_HANDSHAKE);
+	pw_loop_update_timer(impl->io_loop, impl->handshake_timer, NULL, NULL, false);
+	discard_playback(impl);
+
+	schedule_reconnect(impl);
+}
+
+static void on_disconnect_event(void *data, uint64_t count)
+{
+	struct impl *impl = data;
+
+	if (SPA_ATOMIC_LOAD(impl->receive_failed))
+		disconnect(impl);
+}
+
+static void on_reconnect_timeout(void *data, uint64_t expirations)
+{
+	struct impl *impl = data;
+	try_connect(impl);
+}
+
+static void on_socket_watch(void *data, int fd, uint32_t mask)
+{
+	struct impl *impl = data;
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	const char *name;
+	bool found = false;
+	ssize_t len;
+	char *p;
+
+	name = strrchr(impl->socket_path, '/');
+	name = name ? name + 1 : impl->socket_path;
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len; p += sizeof(*event) + event->len) {
+			event = (const struct inotify_event *)p;
+			if (event->len > 0 && spa_streq(event->name, name))
+				found = true;
+		}
+	}
+	if (found && !impl->connected) {
+		pw_log_debug("%s appeared", impl->socket_path);
+		try_connect(impl);
+	}
+}
+
+/* notice the host creating its socket instead of waiting for the retry
+ * timer, nice to have so a failure only costs the fast reconnect */
+static void setup_socket_watch(struct impl *impl)
+{
+	char dir[sizeof(((struct sockaddr_un *)NULL)->sun_path)];
+	const char *p;
+
+	p = strrchr(impl->socket_path, '/');
+	if (p == NULL)
+		snprintf(dir, sizeof(dir), ".");
+	else if (p == impl->socket_path)
+		snprintf(dir, sizeof(dir), "/");
+	else
+		snprintf(dir, sizeof(dir), "%.*s", (int)(p - impl->socket_path),
+				impl->socket_path);
+
+	impl->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (impl->watch_fd < 0) {
+		pw_log_warn("can't watch %s: %m", dir);
+		return;
+	}
+	if (inotify_add_watch(impl->watch_fd, dir,
+				IN_CREATE | IN_MOVED_TO | IN_ATTRIB) < 0) {
+		pw_log_warn("can't watch %s: %m", dir);
+		goto error;
+	}
+	impl->watch_source = pw_loop_add_io(impl->io_loop, impl->watch_fd,
+			SPA_IO_IN, false, on_socket_watch, impl);
+	if (impl->watch_source == NULL) {
+		pw_log_warn("can't watch %s: %m", dir);
+		goto error;
+	}
+	return;
+error:
+	close(impl->watch_fd);
+	impl->watch_fd = -1;
+}
+
+static int do_connect(struct spa_loop *loop, bool async, uint32_t seq,
+		const void *data, size_t size, void *user_data)
+{
+	struct impl *impl = user_data;
+	try_connect(impl);
+	return 0;
+}
+
+static int setup_io_thread(struct impl *impl)
+{
+	static const struct spa_dict_item loop_items[] = {
+		{ "loop.name", "lindroid-io" },
+	};
+	int res;
+
+	impl->io_thread = pw_data_loop_new(&SPA_DICT_INIT_ARRAY(loop_items));
+	if (impl->io_thread == NULL)
+		return -errno;
+
+	impl->io_loop = pw_data_loop_get_loop(impl->io_thread);
+
+	impl->playback_event = pw_loop_add_event(impl->io_loop, on_playback_event, impl);
+	if (impl->playback_event == NULL)
+		return -errno;
+
+	impl->disconnect_event = pw_loop_add_event(impl->io_loop,
+			on_disconnect_event, impl);
+	if (impl->disconnect_event == NULL)
+		return -errno;
+
+	impl->reconnect_timer = pw_loop_add_timer(impl->io_loop,
+			on_reconnect_timeout, impl);
+	if (impl->reconnect_timer == NULL)
+		return -errno;
+
+	impl->handshake_timer = pw_loop_add_timer(impl->io_loop,
+			on_handshake_timeout, impl);
+	if (impl->handshake_timer == NULL)
+		return -errno;
+
+	/* nothing flows until the host answers */
+	impl->protocol = PROTOCOL_HANDSHAKE;
+
+	setup_socket_watch(impl);
+
+	if (impl->driver && (res = setup_driver_timer(impl)) < 0)
+		return res;
+
+	return 0;
+}
+
+/* only once the streams exist, the first connect reaches them from the
+ * io and the receive thread */
+static int start_io_thread(struct impl *impl)
+{
+	int res;
+
+	if ((res = pw_data_loop_start(impl->io_thread)) < 0)
+		return res;
+
+	pw_loop_invoke(impl->io_loop, do_connect, 0, NULL, 0, false, impl);
+	return 0;
+}
+
+static void playback_stream_destroy(void *d)
+{
+	struct playback_stream *pb = d;
+	spa_hook_remove(&pb->listener);
+	pb->stream = NULL;
+}
+
+static void source_stream_destroy(void *d)
+{
+	struct impl *impl = d;
+	spa_hook_remove(&impl->source_stream_listener);
+	impl->source_stream = NULL;
+}
+
+static void stream_state_changed(struct impl *impl, enum pw_stream_state state)
+{
+	switch (state) {
+	case PW_STREAM_STATE_ERROR:
+	case PW_STREAM_STATE_UNCONNECTED:
+		pw_impl_module_schedule_destroy(impl->module);
+		break;
+	case PW_STREAM_STATE_PAUSED:
+	case PW_STREAM_STATE_STREAMING:
+		break;
+	default:
+		break;
+	}
+}
+
+static void playback_state_changed(void *d, enum pw_stream_state old,
+		enum pw_stream_state state, const char *error)
+{
+	struct playback_stream *pb = d;
+	struct impl *impl = pb->impl;
+
+	stream_state_changed(impl, state);
+
+	SPA_ATOMIC_STORE(pb->paused, state != PW_STREAM_STATE_STREAMING);
+	pw_loop_signal_event(impl->io_loop, impl->playback_event);
+}
+
+static void source_state_changed(void *d, enum pw_stream_state old,
+		enum pw_stream_state state, const char *error)
+{
+	struct impl *impl = d;
+
+	stream_state_changed(impl, state);
+
+	/* nobody records, the host can stop capturing */
+	SPA_ATOMIC_STORE(impl->capture_paused, impl->capture_lazy &&
+			state != PW_STREAM_STATE_STREAMING);
+	pw_loop_signal_event(impl->io_loop, impl->playback_event);
+}
+
+static void update_rate(struct impl *impl, struct spa_dll *dll,
+		struct spa_io_rate_match *rate_match, float error)
+{
+	float corr;
+
+	if (!impl->rate_match || impl->driver || rate_match == NULL ||
+	    SPA_ATOMIC_LOAD(impl->protocol) == PROTOCOL_HANDSHAKE)
+		return;
+
+	error = SPA_CLAMP(error, -MAX_ERROR, MAX_ERROR);
+	corr = spa_dll_update(dll, error);
+
+	SPA_FLAG_SET(rate_match->flags, SPA_IO_RATE_MATCH_FLAG_ACTIVE);
+	rate_match->rate = 1.0f / corr;
+}
+
+/* audio the host has not consumed yet: the ring, and the packets of
+ * this stream still in the socket send buffer */
+static uint32_t playback_queued(struct playback_stream *pb, int32_t filled)
+{
+	return SPA_MAX(filled, 0) / playback_frame_size(pb) +
+		SPA_ATOMIC_LOAD(pb->socket_queued);
+}
+
+static void playback_io_changed(void *d, uint32_t id, void *area, uint32_t size)
+{
+	struct playback_stream *pb = d;
+
+	if (id == SPA_IO_RateMatch)
+		pb->rate_match = area;
+}
+
+static void source_io_changed(void *d, uint32_t id, void *area, uint32_t size)
+{
+	struct impl *impl = d;
+
+	switch (id) {
+	case SPA_IO_RateMatch:
+		impl->capture_rate_match = area;
+		break;
+	case SPA_IO_Position:
+		impl->position = area;
+		break;
+	}
+}
+
+static bool stream_format_changed(struct impl *impl, const struct spa_pod *param,
+		const struct spa_audio_info_raw *info)
+{
+	struct spa_audio_info_raw format;
+
+	if (param == NULL || spa_format_audio_raw_parse(param, &format) < 0)
+		return false;
+	if (format.format != SPA_AUDIO_FORMAT_F32P)
+		return false;
+
+	pw_log_info("converting %u channels between F32P and S16LE with %s kernels",
+			info->channels, impl->ops.name);
+	return true;
+}
+
+/* buffers that hold the largest quantum in the negotiated layout, which
+ * saves the graph from guessing. Memfds are preferred so the buffers can be
+ * shared with other processes without a copy. */
+static void update_stream_buffers(struct impl *impl, struct pw_stream *stream,
+		const struct spa_pod *param)
+{
+	struct spa_audio_info_raw format;
+	const struct spa_pod *params[1];
+	uint8_t buffer[1024];
+	struct spa_pod_builder b;
+	uint32_t blocks, stride;
+
+	if (param == NULL || spa_format_audio_raw_parse(param, &format) < 0)
+		return;
+
+	if (format.format == SPA_AUDIO_FORMAT_F32P) {
+		blocks = format.channels;
+		stride = sizeof(float);
+	} else {
+		blocks = 1;
+		stride = sample_size(format.format) * format.channels;
+	}
+
+	spa_pod_builder_init(&b, buffer, sizeof(buffer));
+	params[0] = spa_pod_builder_add_object(&b,
+			SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
+			SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(MIN_STREAM_BUFFERS,
+				MIN_STREAM_BUFFERS, MAX_STREAM_BUFFERS),
+			SPA_PARAM_BUFFERS_blocks, SPA_POD_Int(blocks),
+			SPA_PARAM_BUFFERS_size, SPA_POD_CHOICE_RANGE_Int(
+				impl->max_quantum * stride, stride, INT32_MAX),
+			SPA_PARAM_BUFFERS_stride, SPA_POD_Int(stride),
+			SPA_PARAM_BUFFERS_dataType, SPA_POD_CHOICE_FLAGS_Int(
+				(1 << SPA_DATA_MemFd) | (1 << SPA_DATA_MemPtr)));
+
+	pw_stream_update_params(stream, params, 1);
+}
+
+static void playback_param_changed(void *d, uint32_t id, const struct spa_pod *param)
+{
+	struct playback_stream *pb = d;
+
+	if (id == SPA_PARAM_Format) {
+		pb->convert = stream_format_changed(pb->impl, param, &pb->info);
+		update_stream_buffers(pb->impl, pb->stream, param);
+	}
+}
+
+static void source_param_changed(void *d, uint32_t id, const struct spa_pod *param)
+{
+	struct impl *impl = d;
+
+	if (id == SPA_PARAM_Format) {
+		impl->capture_convert = stream_format_changed(impl, param, &impl->source_info);
+		update_stream_buffers(impl, impl->source_stream, param);
+	}
+}
+
+/* convert straight into the ring when its wrap point falls on a frame,
+ * through the scratch buffer otherwise */
+static void write_playback_converted(struct playback_stream *pb, uint32_t index,
+		const void *src[], uint32_t n_frames)
+{
+	struct impl *impl = pb->impl;
+	uint32_t c, n0, channels = pb->info.channels;
+	uint32_t stride = channels * sizeof(int16_t);
+	const void *s[SPA_AUDIO_MAX_CHANNELS];
+	struct iovec iov[2];
+	void *d[1];
+
+	if (ring_iov(&pb->ring, index, n_frames * stride, iov) == 1 ||
+	    iov[0].iov_len % stride == 0) {
+		n0 = iov[0].iov_len / stride;
+		d[0] = iov[0].iov_base;
+		impl->ops.f32d_to_s16(d, src, channels, n0);
+		if (n0 < n_frames) {
+			for (c = 0; c < channels; c++)
+				s[c] = SPA_PTROFF(src[c], n0 * sizeof(float), void);
+			d[0] = iov[1].iov_base;
+			impl->ops.f32d_to_s16(d, s, channels, n_frames - n0);
+		}
+	} else {
+		d[0] = pb->scratch;
+		impl->ops.f32d_to_s16(d, src, channels, n_frames);
+		spa_ringbuffer_write_data(pb->ring.rb, pb->ring.data,
+				pb->ring.size, index & pb->ring.mask,
+				pb->scratch, n_frames * stride);
+	}
+}
+
+/* planar F32 buffers, returns the number of frames all planes hold */
+static uint32_t get_planes(struct spa_buffer *buf, uint32_t channels, const void *src[])
+{
+	uint32_t c, offs, n_frames = UINT32_MAX;
+	struct spa_data *bd;
+
+	if (buf->n_datas < channels)
+		return 0;
+
+	for (c = 0; c < channels; c++) {
+		bd = &buf->datas[c];
+		if (bd->data == NULL)
+			return 0;
+		offs = SPA_MIN(bd->chunk->offset, bd->maxsize);
+		n_frames = SPA_MIN(n_frames,
+				SPA_MIN(bd->chunk->size, bd->maxsize - offs) / sizeof(float));
+		src[c] = SPA_PTROFF(bd->data, offs, void);
+	}
+	return n_frames;
+}
+
+static bool samples_silent(uint32_t format, const void *data, uint32_t size)
+{
+	uint32_t i;
+
+	switch (format) {
+	case SPA_AUDIO_FORMAT_F32P:
+	case SPA_AUDIO_FORMAT_F32_LE: {
+		const float *s = data;
+		for (i = 0; i < size / sizeof(float); i++)
+			if (fabsf(s[i]) > SILENCE_THRESHOLD)
+				return false;
+		return true;
+	}
+	case SPA_AUDIO_FORMAT_S16_LE: {
+		const int16_t *s = data;
+		for (i = 0; i < size / sizeof(int16_t); i++)
+			if (s[i] > 1 || s[i] < -1)
+				return false;
+		return true;
+	}
+	default: {
+		const uint8_t *s = data;
+		for (i = 0; i < size; i++)
+			if (s[i] != 0)
+				return false;
+		return true;
+	}
+	}
+}
+
+/* track silence on the stream, true while it is suspended and the period
+ * can be dropped */
+static bool playback_silent(struct playback_stream *pb, const void *src[],
+		const void *data, uint32_t size, uint32_t n_frames)
+{
+	struct impl *impl = pb->impl;
+	bool silent = true;
+	uint32_t c;
+
+	if (impl->suspend_msec == 0 ||
+	    SPA_ATOMIC_LOAD(impl->protocol) != PROTOCOL_FRAMED)
+		return false;
+
+	if (pb->convert) {
+		for (c = 0; c < pb->info.channels && silent; c++)
+			silent = samples_silent(SPA_AUDIO_FORMAT_F32P, src[c],
+					n_frames * sizeof(float));
+	} else {
+		n_frames = size / playback_frame_size(pb);
+		silent = samples_silent(pb->info.format, data, size);
+	}
+
+	if (!silent) {
+		pb->silent_frames = 0;
+		if (pb->silent) {
+			/* the queue ran dry meanwhile, start matching over */
+			spa_dll_init(&pb->dll);
+			spa_dll_set_bw(&pb->dll, SPA_DLL_BW_MIN, DLL_PERIOD, pb->info.rate);
+			SPA_ATOMIC_STORE(pb->silent, false);
+		}
+		return false;
+	}
+
+	pb->silent_frames += n_frames;
+	if (!pb->silent && pb->silent_frames * 1000 >=
+	    (uint64_t)impl->suspend_msec * pb->info.rate) {
+		SPA_ATOMIC_STORE(pb->silent, true);
+		pw_loop_signal_event(impl->io_loop, impl->playback_event);
+	}
+	return pb->silent;
+}
+
+/* append size bytes of stream 0 from its ring at index, silence when the
+ * ring is NULL, so the history keeps the pace of the speaker */
+static void aec_append(struct impl *impl, struct ring *from, uint32_t index,
+		uint32_t size)
+{
+	struct ring *h = &impl->aec_history;
+	struct iovec iov[2];
+	uint32_t w, offs = 0;
+	int i, n_iov;
+
+	spa_ringbuffer_get_write_index(h->rb, &w);
+	n_iov = ring_iov(h, w, SPA_MIN(size, h->size), iov);
+
+	for (i = 0; i < n_iov; i++) {
+		if (from == NULL)
+			memset(iov[i].iov_base, 0, iov[i].iov_len);
+		else
+			spa_ringbuffer_read_data(from->rb, from->data, from->size,
+					(index + offs) & from->mask,
+					iov[i].iov_base, iov[i].iov_len);
+		offs += iov[i].iov_len;
+	}
+	spa_ringbuffer_write_update(h->rb, w + size);
+}
+
+static void process_playback(struct playback_stream *pb)
+{
+	struct impl *impl = pb->impl;
+	struct pw_buffer *buf;
+	struct spa_data *bd;
+	const void *src[SPA_AUDIO_MAX_CHANNELS];
+	void *data = NULL;
+	uint32_t offs, size, index, limit, queued, n_frames = 0;
+	int32_t filled;
+	bool written = false;
+
+	if ((buf = pw_stream_dequeue_buffer(pb->stream)) == NULL) {
+		rt_message(impl, RT_MSG_PLAYBACK_NO_BUFFER, errno);
+		return;
+	}
+
+	if (pb->convert) {
+		n_frames = get_planes(buf->buffer, pb->info.channels, src);
+		size = n_frames * pb->info.channels * sizeof(int16_t);
+	} else {
+		bd = &buf->buffer->datas[0];
+
+		offs = SPA_MIN(bd->chunk->offset, bd->maxsize);
+		size = SPA_MIN(bd->chunk->size, bd->maxsize - offs);
+		data = SPA_PTROFF(bd->data, offs, void);
+	}
+
+	if (playback_silent(pb, src, data, size, n_frames)) {
+		if (pb->id == 0 && impl->aec_reference)
+			aec_append(impl, NULL, 0, size);
+		pw_stream_queue_buffer(pb->stream, buf);
+		return;
+	}
+
+	filled = spa_ringbuffer_get_write_index(pb->ring.rb, &index);
+	queued = playback_queued(pb, filled);
+	SPA_ATOMIC_STORE(pb->queued, queued);
+	cycle_stats_fill(&pb->stats, queued);
+	update_rate(impl, &pb->dll, pb->rate_match, (float)pb->target - (float)queued);
+
+	limit = impl->drop_policy == DROP_POLICY_NEWEST ?
+		pb->high_water : pb->ring.size;
+
+	if (filled < 0 || (uint32_t)filled + size > limit) {
+		/* the reader is behind, keep the graph going */
+		SPA_ATOMIC_INC(pb->drops);
+		pb->batched = impl->batch_periods;
+	} else {
+		if (pb->convert)
+			write_playback_converted(pb, index, src, n_frames);
+		else
+			spa_ringbuffer_write_data(pb->ring.rb, pb->ring.data,
+					pb->ring.size, index & pb->ring.mask, data, size);
+		spa_ringbuffer_write_update(pb->ring.rb, index + size);
+		filled += size;
+		written = true;
+	}
+
+	if (pb->id == 0 && impl->aec_reference)
+		aec_append(impl, written ? &pb->ring : NULL, index, size);
+
+	/* wake the reader once per batch */
+	if (++pb->batched >= impl->batch_periods ||
+	    (impl->batch_bytes > 0 && filled >= (int32_t)impl->batch_bytes)) {
+		pb->batched = 0;
+		if (pb->id == 0 && SPA_ATOMIC_LOAD(impl->shm_active))
+			eventfd_write(impl->shm_eventfd, 1);
+		else
+			pw_loop_signal_event(impl->io_loop, impl->playback_event);
+	}
+
+	pw_stream_queue_buffer(pb->stream, buf);
+}
+
+static void playback_stream_process(void *d)
+{
+	struct playback_stream *pb = d;
+	uint64_t start = get_time_ns();
+
+	process_playback(pb);
+	cycle_stats_add(&pb->stats, start);
+}
+
+static void fill_underrun(struct impl *impl, uint8_t *dst, uint32_t size)
+{
+	uint32_t frame_size = sample_size(impl->source_info.format) * impl->source_info.channels;
+	uint32_t i, c, n_frames = size / frame_size;
+
+	switch (impl->underrun_fill) {
+	case UNDERRUN_FILL_REPEAT:
+		for (i = 0; i < n_frames; i++)
+			memcpy(dst + i * frame_size, impl->last_frame, frame_size);
+		break;
+	case UNDERRUN_FILL_FADE:
+		if (impl->source_info.format == SPA_AUDIO_FORMAT_S16 && n_frames > 0) {
+			const int16_t *s = (const int16_t *)impl->last_frame;
+			int16_t *d = (int16_t *)dst;
+
+			for (i = 0; i < n_frames; i++)
+				for (c = 0; c < impl->source_info.channels; c++)
+					*d++ = s[c] * (int32_t)(n_frames - i - 1) / (int32_t)n_frames;
+
+			/* faded out, the next underrun starts from silence */
+			memset(impl->last_frame, 0, frame_size);
+			break;
+		}
+		SPA_FALLTHROUGH;
+	case UNDERRUN_FILL_SILENCE:
+		n_frames = 0;
+		break;
+	}
+	memset(dst + n_frames * frame_size, 0, size - n_frames * frame_size);
+}
+
+static void read_capture_converted(struct impl *impl, uint32_t index,
+		void *dst[], uint32_t n_frames)
+{
+	uint32_t c, n0, channels = impl->source_info.channels;
+	uint32_t stride = channels * sizeof(int16_t);
+	void *d[SPA_AUDIO_MAX_CHANNELS];
+	const void *s[1];
+	struct iovec iov[2];
+
+	if (ring_iov(&impl->capture, index, n_frames * stride, iov) == 1 ||
+	    iov[0].iov_len % stride == 0) {
+		n0 = iov[0].iov_len / stride;
+		s[0] = iov[0].iov_base;
+		impl->ops.s16_to_f32d(dst, s, channels, n0);
+		if (n0 < n_frames) {
+			for (c = 0; c < channels; c++)
+				d[c] = SPA_PTROFF(dst[c], n0 * sizeof(float), void);
+			s[0] = iov[1].iov_base;
+			impl->ops.s16_to_f32d(d, s, channels, n_frames - n0);
+		}
+	} else {
+		spa_ringbuffer_read_data(impl->capture.rb, impl->capture.data,
+				impl->capture.size, index & impl->capture.mask,
+				impl->capture_scratch, n_frames * stride);
+		s[0] = impl->capture_scratch;
+		impl->ops.s16_to_f32d(dst, s, channels, n_frames);
+	}
+}
+
+/* capture straight from the S16 ring into the planar F32 stream buffers */
+static void source_process_converted(struct impl *impl, struct pw_buffer *b)
+{
+	struct spa_buffer *buf = b->buffer;
+	uint32_t c, index, channels = impl->source_info.channels;
+	uint32_t frame_size = channels * sizeof(int16_t);
+	uint32_t n_frames, n_copy;
+	void *dst[SPA_AUDIO_MAX_CHANNELS];
+	const void *s[1];
+	int32_t avail;
+
+	if (buf->n_datas < channels)
+		return;
+
+	n_frames = b->requested ? b->requested : UINT32_MAX;
+	for (c = 0; c < channels; c++) {
+		if ((dst[c] = buf->datas[c].data) == NULL)
+			return;
+		n_frames = SPA_MIN(n_frames, buf->datas[c].maxsize / sizeof(float));
+	}
+
+	avail = spa_ringbuffer_get_read_index(impl->capture.rb, &index);
+	n_copy = SPA_MIN(n_frames, (uint32_t)SPA_MAX(avail, 0) / frame_size);
+
+	if (n_copy > 0) {
+		read_capture_converted(impl, index, dst, n_copy);
+		spa_ringbuffer_read_data(impl->capture.rb, impl->capture.data,
+				impl->capture.size, (index + (n_copy - 1) * frame_size) & impl->capture.mask,
+				impl->last_frame, frame_size);
+		spa_ringbuffer_read_update(impl->capture.rb, index + n_copy * frame_size);
+	}
+
+	if (n_copy < n_frames) {
+		/* pad in the host format so all fill modes behave the same */
+		fill_underrun(impl, impl->capture_scratch, (n_frames - n_copy) * frame_size);
+		for (c = 0; c < channels; c++)
+			dst[c] = SPA_PTROFF(dst[c], n_copy * sizeof(float), void);
+		s[0] = impl->capture_scratch;
+		impl->ops.s16_to_f32d(dst, s, channels, n_frames - n_copy);
+		impl->capture_underruns++;
+	}
+
+	for (c = 0; c < channels; c++) {
+		buf->datas[c].chunk->offset = 0;
+		buf->datas[c].chunk->stride = sizeof(float);
+		buf->datas[c].chunk->size = n_frames * sizeof(float);
+	}
+	b->size = n_frames;
+}
+
+static void driver_done(struct impl *impl)
+{
+	if (!impl->driver)
+		return;
+
+	SPA_ATOMIC_INC(impl->driver_cycles);
+	SPA_ATOMIC_STORE(impl->driver_busy, false);
+}
+
+/* the jitter buffer: rate matching stretches the queue towards the target,
+ * what piles up beyond the maximum is skipped down to it */
+static void update_capture_rate(struct impl *impl)
+{
+	uint32_t index, frame_size = sample_size(impl->source_info.format) * impl->source_info.channels;
+	int32_t avail = spa_ringbuffer_get_read_index(impl->capture.rb, &index);
+	uint32_t queued = SPA_MAX(avail, 0) / frame_size;
+	uint32_t target = SPA_ATOMIC_LOAD(impl->capture_target), skip;
+
+	if (impl->capture_max > 0 && queued > impl->capture_max) {
+		skip = queued - target;
+		spa_ringbuffer_read_update(impl->capture.rb, index + skip * frame_size);
+		rt_message(impl, RT_MSG_CAPTURE_SKIP, skip * frame_size);
+		SPA_ATOMIC_INC(impl->capture_skips);
+		queued = target;
+	}
+
+	SPA_ATOMIC_STORE(impl->capture_queued, queued);
+	cycle_stats_fill(&impl->capture_stats, queued);
+	update_rate(impl, &impl->capture_dll, impl->capture_rate_match,
+			(float)queued - (float)target);
+}
+
+static void process_capture(struct impl *impl)
+{
+	struct pw_buffer *b;
+	struct spa_buffer *buf;
+	uint8_t *dst;
+	uint32_t frame_size = sample_size(impl->source_info.format) * impl->source_info.channels;
+	uint32_t index, n_frames, n_copy;
+	int32_t avail;
+
+	if ((b = pw_stream_dequeue_buffer(impl->source_stream)) == NULL) {
+		rt_message(impl, RT_MSG_CAPTURE_NO_BUFFER, errno);
+		return;
+	}
+
+	update_capture_rate(impl);
+
+	if (impl->capture_convert) {
+		source_process_converted(impl, b);
+		pw_stream_queue_buffer(impl->source_stream, b);
+		driver_done(impl);
+		return;
+	}
+
+	buf = b->buffer;
+	if ((dst = buf->datas[0].data) == NULL) {
+		pw_stream_queue_buffer(impl->source_stream, b);
+		driver_done(impl);
+		return;
+	}
+
+	/* whole frames of the negotiated format only, the ring read below
+	 * takes care of the wrap around */
+	n_frames = buf->datas[0].maxsize / frame_size;
+	if (b->requested)
+		n_frames = SPA_MIN(n_frames, (uint32_t)b->requested);
+
+	avail = spa_ringbuffer_get_read_index(impl->capture.rb, &index);
+	n_copy = SPA_MIN(n_frames, (uint32_t)SPA_MAX(avail, 0) / frame_size);
+
+	if (n_copy > 0) {
+		spa_ringbuffer_read_data(impl->capture.rb, impl->capture.data, impl->capture.size,
+				index & impl->capture.mask, dst, n_copy * frame_size);
+		spa_ringbuffer_read_update(impl->capture.rb, index + n_copy * frame_size);
+		memcpy(impl->last_frame, dst + (n_copy - 1) * frame_size, frame_size);
+	}
+
+	if (n_copy < n_frames) {
+		/* never wait for the host here, pad the rest of the cycle */
+		fill_underrun(impl, dst + n_copy * frame_size, (n_frames - n_copy) * frame_size);
+		impl->capture_underruns++;
+	}
+
+	buf->datas[0].chunk->offset = 0;
+	buf->datas[0].chunk->stride = frame_size;
+	buf->datas[0].chunk->size = n_frames * frame_size;
+	b->size = n_frames;
+
+	pw_stream_queue_buffer(impl->source_stream, b);
+	driver_done(impl);
+}
+
+static void source_playback_process(void *data) {
+	struct impl *impl = (struct impl*)data;
+	uint64_t start = get_time_ns();
+
+	process_capture(impl);
+	cycle_stats_add(&impl->capture_stats, start);
+}
+
+static void reference_stream_destroy(void *d)
+{
+	struct impl *impl = d;
+	spa_hook_remove(&impl->aec_stream_listener);
+	impl->aec_stream = NULL;
+}
+
+static void reference_state_changed(void *d, enum pw_stream_state old,
+		enum pw_stream_state state, const char *error)
+{
+	struct impl *impl = d;
+
+	stream_state_changed(impl, state);
+}
+
+static void reference_param_changed(void *d, uint32_t id, const struct spa_pod *param)
+{
+	struct impl *impl = d;
+
+	if (id == SPA_PARAM_Format)
+		update_stream_buffers(impl, impl->aec_stream, param);
+}
+
+/* what stream 0 wrote aec_delay frames ago. The reference reads on at its
+ * own pace and only realigns when the delay changes or it fell behind, it
+ * plays silence while the history does not advance. */
+static void reference_process(void *data)
+{
+	struct impl *impl = data;
+	struct playback_stream *pb = &impl->playbacks[0];
+	struct ring *h = &impl->aec_history;
+	uint32_t frame_size = playback_frame_size(pb);
+	uint32_t index, size, delay, target;
+	int32_t drift, avail;
+	struct pw_buffer *b;
+	struct spa_buffer *buf;
+	uint8_t *dst;
+
+	if ((b = pw_stream_dequeue_buffer(impl->aec_stream)) == NULL) {
+		rt_message(impl, RT_MSG_REFERENCE_NO_BUFFER, errno);
+		return;
+	}
+
+	buf = b->buffer;
+	if ((dst = buf->datas[0].data) == NULL) {
+		pw_stream_queue_buffer(impl->aec_stream, b);
+		return;
+	}
+
+	size = buf->datas[0].maxsize / frame_size;
+	if (b->requested)
+		size = SPA_MIN(size, (uint32_t)b->requested);
+	size *= frame_size;
+
+	spa_ringbuffer_get_write_index(h->rb, &index);
+	delay = SPA_ATOMIC_LOAD(impl->aec_delay);
+	target = index - delay * frame_size - size;
+	drift = (int32_t)(impl->aec_read - target);
+
+	/* stream 0 and the reference run in the same graph, either may go
+	 * first in a cycle, so the drift swings by one period */
+	if (!impl->aec_read_valid || delay != impl->aec_read_delay ||
+	    drift < -(int32_t)(2 * size)) {
+		impl->aec_read = target;
+		impl->aec_read_delay = delay;
+		impl->aec_read_valid = true;
+		drift = 0;
+	}
+
+	avail = (int32_t)(index - impl->aec_read);
+	if (drift > (int32_t)(2 * size) || avail < (int32_t)size ||
+	    avail > (int32_t)h->size) {
+		/* stream 0 stalled, wait for the history to catch up */
+		memset(dst, 0, size);
+	} else {
+		spa_ringbuffer_read_data(h->rb, h->data, h->size,
+				impl->aec_read & h->mask, dst, size);
+		impl->aec_read += size;
+	}
+
+	buf->datas[0].chunk->offset = 0;
+	buf->datas[0].chunk->stride = frame_size;
+	buf->datas[0].chunk->size = size;
+	b->size = size / frame_size;
+
+	pw_stream_queue_buffer(impl->aec_stream, b);
+}
+
+static const struct pw_stream_events playback_stream_events = {
+	PW_VERSION_STREAM_EVENTS,
+	.destroy = playback_stream_destroy,
+	.state_changed = playback_state_changed,
+	.io_changed = playback_io_changed,
+	.param_changed = playback_param_changed,
+	.process = playback_stream_process
+};
+
+static const struct pw_stream_events input_stream_events = {
+	PW_VERSION_STREAM_EVENTS,
+	.destroy = source_stream_destroy,
+	.state_changed = source_state_changed,
+	.io_changed = source_io_changed,
+	.param_changed = source_param_changed,
+	.process = source_playback_process
+};
+
+static const struct pw_stream_events reference_stream_events = {
+	PW_VERSION_STREAM_EVENTS,
+	.destroy = reference_stream_destroy,
+	.state_changed = reference_state_changed,
+	.param_changed = reference_param_changed,
+	.process = reference_process
+};
+
+/* the cycle stats of one stream as properties, false when it did not run */
+static bool collect_cycle_stats(struct cycle_stats *s, struct cycle_stats *last,
+		struct pw_properties *props)
+{
+	uint64_t cycles = SPA_ATOMIC_LOAD(s->cycles);
+	uint64_t nsec = SPA_ATOMIC_LOAD(s->nsec);
+	uint32_t max_nsec = SPA_ATOMIC_XCHG(s->max_nsec, 0);
+	uint32_t fill_min = SPA_ATOMIC_XCHG(s->fill_min, UINT32_MAX);
+	uint32_t fill_max = SPA_ATOMIC_XCHG(s->fill_max, 0);
+	char hist[STATS_HIST_BUCKETS * 12 + 4];
+	int i, len;
+
+	if (cycles == last->cycles)
+		return false;
+
+	len = snprintf(hist, sizeof(hist), "[");
+	for (i = 0; i < STATS_HIST_BUCKETS; i++)
+		len += snprintf(hist + len, sizeof(hist) - len, " %u",
+				SPA_ATOMIC_LOAD(s->hist[i]));
+	snprintf(hist + len, sizeof(hist) - len, " ]");
+
+	pw_properties_setf(props, "lindroid.stats.cycles", "%" PRIu64, cycles);
+	pw_properties_setf(props, "lindroid.stats.cycle.avg-usec", "%" PRIu64,
+			(uint64_t)((nsec - last->nsec) / (cycles - last->cycles) / SPA_NSEC_PER_USEC));
+	pw_properties_setf(props, "lindroid.stats.cycle.max-usec", "%u",
+			max_nsec / (uint32_t)SPA_NSEC_PER_USEC);
+	pw_properties_set(props, "lindroid.stats.cycle.histogram", hist);
+	pw_properties_setf(props, "lindroid.stats.fill.min", "%u",
+			fill_min == UINT32_MAX ? 0 : fill_min);
+	pw_properties_setf(props, "lindroid.stats.fill.max", "%u", fill_max);
+
+	last->cycles = cycles;
+	last->nsec = nsec;
+	return true;
+}
+
+static void collect_transport_stats(struct transport_stats *s, struct transport_stats *last,
+		const char *prefix, uint32_t sec, struct pw_properties *props)
+{
+	uint64_t bytes = SPA_ATOMIC_LOAD(s->bytes);
+	uint64_t packets = SPA_ATOMIC_LOAD(s->packets);
+	uint64_t nsec = SPA_ATOMIC_LOAD(s->nsec);
+	char key[64];
+
+	snprintf(key, sizeof(key), "%s.bytes-per-sec", prefix);
+	pw_properties_setf(props, key, "%" PRIu64, (bytes - last->bytes) / sec);
+	snprintf(key, sizeof(key), "%s.packets-per-sec", prefix);
+	pw_properties_setf(props, key, "%" PRIu64, (packets - last->packets) / sec);
+	snprintf(key, sizeof(key), "%s.avg-usec", prefix);
+	pw_properties_setf(props, key, "%" PRIu64, packets == last->packets ? 0 :
+			(uint64_t)((nsec - last->nsec) / (packets - last->packets) / SPA_NSEC_PER_USEC));
+
+	last->bytes = bytes;
+	last->packets = packets;
+	last->nsec = nsec;
+}
+
+/* pushed to the node and module properties from the main loop, the RT
+ * process never waits for it */
+static void publish_stats(struct impl *impl, uint32_t sec)
+{
+	struct pw_properties *props;
+	struct playback_stream *pb;
+	uint32_t i;
+
+	for (i = 0; i < impl->n_playbacks; i++) {
+		pb = &impl->playbacks[i];
+		if (pb->stream == NULL ||
+		    (props = pw_properties_new(NULL, NULL)) == NULL)
+			continue;
+		if (collect_cycle_stats(&pb->stats, &pb->reported_stats, props)) {
+			pw_properties_setf(props, "lindroid.stats.drops", "%u",
+					SPA_ATOMIC_LOAD(pb->drops));
+			pw_stream_update_properties(pb->stream, &props->dict);
+		}
+		pw_properties_free(props);
+	}
 
-	if ((buf = pw_stream_dequeue_buffer(impl->stream)) == NULL) {
-		pw_log_debug("out of buffers: %m");
-		return;
+	if (impl->source_stream != NULL &&
+	    (props = pw_properties_new(NULL, NULL)) != NULL) {
+		if (collect_cycle_stats(&impl->capture_stats,
+				&impl->capture_reported_stats, props)) {
+			pw_properties_setf(props, "lindroid.stats.underruns", "%u",
+					SPA_ATOMIC_LOAD(impl->capture_underruns));
+			pw_properties_setf(props, "lindroid.stats.overruns", "%u",
+					SPA_ATOMIC_LOAD(impl->capture_overruns));
+			pw_properties_setf(props, "lindroid.stats.lost", "%u",
+					SPA_ATOMIC_LOAD(impl->capture_lost));
+			pw_properties_setf(props, "lindroid.stats.skips", "%u",
+					SPA_ATOMIC_LOAD(impl->capture_skips));
+			pw_properties_setf(props, "lindroid.stats.depth.target-msec", "%u",
+					SPA_ATOMIC_LOAD(impl->capture_target) * 1000 /
+					impl->source_info.rate);
+			pw_properties_setf(props, "lindroid.stats.depth.msec", "%u",
+					SPA_ATOMIC_LOAD(impl->capture_queued) * 1000 /
+					impl->source_info.rate);
+			pw_properties_setf(props, "lindroid.stats.jitter-usec", "%u",
+					SPA_ATOMIC_LOAD(impl->capture_jitter) /
+					(uint32_t)SPA_NSEC_PER_USEC);
+			pw_stream_update_properties(impl->source_stream, &props->dict);
+		}
+		pw_properties_free(props);
 	}
 
-	bd = &buf->buffer->datas[0];
+	if (SPA_ATOMIC_LOAD(impl->send_stats.packets) == impl->reported_send.packets &&
+	    SPA_ATOMIC_LOAD(impl->recv_stats.packets) == impl->reported_recv.packets)
+		return;
 
-	offs = SPA_MIN(bd->chunk->offset, bd->maxsize);
-	size = SPA_MIN(bd->chunk->size, bd->maxsize - offs);
-	data = SPA_PTROFF(bd->data, offs, void);
+	if ((props = pw_properties_new(NULL, NULL)) == NULL)
+		return;
+	collect_transport_stats(&impl->send_stats, &impl->reported_send,
+			"lindroid.stats.send", sec, props);
+	collect_transport_stats(&impl->recv_stats, &impl->reported_recv,
+			"lindroid.stats.recv", sec, props);
+	pw_impl_module_update_properties(impl->module, &props->dict);
+	pw_properties_free(props);
+}
 
-	if (impl->audio_socket_fd != -1) {
-		if(size>=10239) {
-			pw_log_error("buffer too big");
-			return;
-		}
+static void log_rt_message(enum rt_message id, uint32_t count, uint64_t total,
+		uint32_t last, uint32_t sec)
+{
+	const struct rt_message_info *info = &rt_messages[id];
+
+	if (sec == 0 && info->unit == NULL)
+		pw_log(info->level, "%s: %s", info->text, spa_strerror(-(int)last));
+	else if (sec == 0)
+		pw_log(info->level, "%s, %u %s", info->text, last, info->unit);
+	else if (info->unit == NULL)
+		pw_log(info->level, "%s %u times in last %us, last: %s",
+				info->text, count, sec, spa_strerror(-(int)last));
+	else
+		pw_log(info->level, "%s %u times, %" PRIu64 " %s in last %us",
+				info->text, count, total, info->unit, sec);
+}
 
-		uint8_t prefixed_data[size + 1];
-		prefixed_data[0] = AUDIO_OUTPUT_PREFIX;
-		memcpy(prefixed_data + 1, data, size);
+/* the first message after a quiet interval */
+static void on_rt_message(void *data, uint64_t count)
+{
+	struct impl *impl = data;
+	struct rt_message_state *m;
+	uint32_t i, last;
+
+	for (i = 0; i < N_RT_MESSAGES; i++) {
+		m = &impl->rt_state[i];
+		if (m->announced || !SPA_ATOMIC_LOAD(m->muted))
+			continue;
+
+		last = SPA_ATOMIC_LOAD(m->last);
+		log_rt_message(i, 1, last, last, 0);
+		m->announced = true;
+		m->reported_count++;
+		m->reported_total += last;
+	}
+}
 
-		ssize_t sent = send(impl->audio_socket_fd, prefixed_data, size + 1, 0);
-		if (sent == -1) {
-			pw_log_error("Failed to send audio data: %m");
-		} else {
-			pw_log_info("Sent %zd bytes of audio data", sent);
+/* everything after it, once per interval until they stop */
+static void summarize_rt_messages(struct impl *impl, uint32_t sec)
+{
+	struct rt_message_state *m;
+	uint32_t i, count;
+	uint64_t total;
+
+	for (i = 0; i < N_RT_MESSAGES; i++) {
+		m = &impl->rt_state[i];
+		if (!m->announced)
+			continue;
+
+		count = SPA_ATOMIC_LOAD(m->count);
+		total = SPA_ATOMIC_LOAD(m->total);
+		if (count == m->reported_count) {
+			m->announced = false;
+			SPA_ATOMIC_STORE(m->muted, false);
+			continue;
 		}
-	} else {
-		pw_log_error("Audio socket is not connected");
+
+		log_rt_message(i, count - m->reported_count, total - m->reported_total,
+				SPA_ATOMIC_LOAD(m->last), sec);
+		m->reported_count = count;
+		m->reported_total = total;
 	}
-	pw_stream_queue_buffer(impl->stream, buf);
 }
 
-static void source_playback_process(void *data) {
-	struct pw_buffer *b;
-	struct spa_buffer *buf;
-	uint8_t *dst;
-	struct impl *impl = (struct impl*)data;
+static void stats_timer_expired(void *data, uint64_t expirations)
+{
+	struct impl *impl = data;
+	uint32_t underruns = SPA_ATOMIC_LOAD(impl->capture_underruns);
+	uint32_t overruns = SPA_ATOMIC_LOAD(impl->capture_overruns);
+	uint32_t lost = SPA_ATOMIC_LOAD(impl->capture_lost);
+	uint32_t i, drops = 0;
+
+	for (i = 0; i < impl->n_playbacks; i++)
+		drops += SPA_ATOMIC_LOAD(impl->playbacks[i].drops);
+
+	if (underruns != impl->reported_underruns ||
+	    overruns != impl->reported_overruns ||
+	    lost != impl->reported_lost)
+		pw_log_info("capture: %u underruns (+%u), %u overruns (+%u), "
+				"%u lost (+%u) in last %ds",
+				underruns, underruns - impl->reported_underruns,
+				overruns, overruns - impl->reported_overruns,
+				lost, lost - impl->reported_lost,
+				STATS_INTERVAL_SEC);
+
+	if (drops != impl->reported_drops)
+		pw_log_info("playback: %u drops (+%u) in last %ds",
+				drops, drops - impl->reported_drops,
+				STATS_INTERVAL_SEC);
+
+	impl->reported_underruns = underruns;
+	impl->reported_overruns = overruns;
+	impl->reported_lost = lost;
+	impl->reported_drops = drops;
+
+	publish_stats(impl, SPA_MAX(expirations, 1u) * STATS_INTERVAL_SEC);
+	summarize_rt_messages(impl, SPA_MAX(expirations, 1u) * STATS_INTERVAL_SEC);
+}
 
-	if ((b = pw_stream_dequeue_buffer(impl->source_stream)) == NULL) {
-		pw_log_debug("Out of playback buffers: %m");
-		return;
-	}
+static void publish_latency(struct pw_stream *stream, enum spa_direction direction,
+		uint32_t *reported, uint32_t frames, uint32_t rate)
+{
+	struct spa_latency_info latency;
+	const struct spa_pod *params[1];
+	uint8_t buffer[1024];
+	struct spa_pod_builder b;
+	uint32_t diff = frames > *reported ? frames - *reported : *reported - frames;
 
-	buf = b->buffer;
-	if ((dst = buf->datas[0].data) == NULL)
+	if (stream == NULL || diff <= (uint64_t)rate * LATENCY_THRESHOLD_MSEC / 1000)
 		return;
 
-	buf->datas[0].chunk->offset = 0;
-	buf->datas[0].chunk->stride = 4;
-	buf->datas[0].chunk->size = 0;
+	*reported = frames;
 
-	size_t requested_size = SPA_MIN(b->requested * 4, buf->datas[0].maxsize);
-	size_t available_size = 0;
+	spa_pod_builder_init(&b, buffer, sizeof(buffer));
+	latency = SPA_LATENCY_INFO(direction);
+	latency.min_rate = latency.max_rate = frames;
+	params[0] = spa_latency_build(&b, SPA_PARAM_Latency, &latency);
+	pw_stream_update_params(stream, params, 1);
+}
 
-	pthread_mutex_lock(&buffer_mutex);
-	while (audio_buffer_start == audio_buffer_end) {
-		pthread_cond_wait(&buffer_cond, &buffer_mutex); // Wait for data to be available
-	}
+/* enough queued capture to ride out the jitter of the host, never less than
+ * configured and never so much that the maximum skips right away */
+static void update_capture_target(struct impl *impl)
+{
+	uint64_t jitter = SPA_ATOMIC_LOAD(impl->capture_jitter);
+	uint32_t target = jitter * JITTER_FACTOR * impl->source_info.rate / SPA_NSEC_PER_SEC;
+
+	target = SPA_MAX(target, impl->capture_base_target);
+	if (impl->capture_max > 0)
+		target = SPA_MIN(target, SPA_MAX(impl->capture_max / 2,
+					impl->capture_base_target));
+	SPA_ATOMIC_STORE(impl->capture_target, target);
+}
 
-	if (audio_buffer_end > audio_buffer_start) {
-		available_size = audio_buffer_end - audio_buffer_start;
-	} else {
-		available_size = BUFFER_SIZE - audio_buffer_start;
+/* everything between the graph and the speaker or microphone: our queue,
+ * the host app and what the host reports for the HAL */
+static void latency_timer_expired(void *data, uint64_t expirations)
+{
+	struct impl *impl = data;
+	struct playback_stream *pb;
+	uint32_t i, frames, playback = 0, max;
+
+	for (i = 0; i < impl->n_playbacks; i++) {
+		pb = &impl->playbacks[i];
+		frames = SPA_ATOMIC_LOAD(pb->queued) +
+			SPA_ATOMIC_LOAD(pb->host_buffered) +
+			SPA_ATOMIC_LOAD(pb->host_device);
+		publish_latency(pb->stream, SPA_DIRECTION_OUTPUT,
+				&pb->reported_latency, frames, pb->info.rate);
+		if (i == 0)
+			playback = frames;
 	}
 
-	size_t copy_size = SPA_MIN(requested_size, available_size);
-	memcpy(dst, audio_buffer + audio_buffer_start, copy_size);
-	audio_buffer_start = (audio_buffer_start + copy_size) % BUFFER_SIZE;
+	frames = SPA_ATOMIC_LOAD(impl->capture_queued) +
+		SPA_ATOMIC_LOAD(impl->capture_host_buffered) +
+		SPA_ATOMIC_LOAD(impl->capture_host_device);
+	publish_latency(impl->source_stream, SPA_DIRECTION_INPUT,
+			&impl->capture_reported_latency, frames, impl->source_info.rate);
 
-	pthread_mutex_unlock(&buffer_mutex);
+	if (impl->capture_adaptive)
+		update_capture_target(impl);
 
-	buf->datas[0].chunk->size = copy_size;
-	b->size = copy_size / 4;
+	if (!impl->aec_reference)
+		return;
 
-	pw_stream_queue_buffer(impl->source_stream, b);
+	/* what is captured now was recorded the capture latency ago, and
+	 * what played then was written the playback latency before that */
+	pb = &impl->playbacks[0];
+	frames = playback + (uint64_t)frames * pb->info.rate / impl->source_info.rate;
+	max = impl->aec_history.size / playback_frame_size(pb);
+	max = max > 2 * impl->max_quantum ? max - 2 * impl->max_quantum : 0;
+	SPA_ATOMIC_STORE(impl->aec_delay, SPA_MIN(frames, max));
 }
 
-static const struct pw_stream_events playback_stream_events = {
-	PW_VERSION_STREAM_EVENTS,
-	.destroy = stream_destroy,
-	.state_changed = stream_state_changed,
-	.process = playback_stream_process
-};
+static int start_latency_timer(struct impl *impl)
+{
+	struct timespec value;
 
-static const struct pw_stream_events input_stream_events = {
-	PW_VERSION_STREAM_EVENTS,
-	.destroy = stream_destroy,
-	.state_changed = stream_state_changed,
-	.process = source_playback_process
-};
+	impl->latency_timer = pw_loop_add_timer(impl->main_loop, latency_timer_expired, impl);
+	if (impl->latency_timer == NULL)
+		return -errno;
+
+	value.tv_sec = 0;
+	value.tv_nsec = LATENCY_INTERVAL_MSEC * SPA_NSEC_PER_MSEC;
+	pw_loop_update_timer(impl->main_loop, impl->latency_timer, &value, &value, false);
+
+	return 0;
+}
+
+static int start_stats_timer(struct impl *impl)
+{
+	struct timespec value, interval;
+
+	impl->stats_timer = pw_loop_add_timer(impl->main_loop, stats_timer_expired, impl);
+	if (impl->stats_timer == NULL)
+		return -errno;
+
+	impl->rt_message_event = pw_loop_add_event(impl->main_loop, on_rt_message, impl);
+	if (impl->rt_message_event == NULL)
+		return -errno;
+
+	value.tv_sec = interval.tv_sec = STATS_INTERVAL_SEC;
+	value.tv_nsec = interval.tv_nsec = 0;
+	pw_loop_update_timer(impl->main_loop, impl->stats_timer, &value, &interval, false);
 
+	return 0;
+}
 
 static int create_stream(struct impl *impl)
 {
+	struct playback_stream *pb;
 	int res;
-	uint32_t n_params;
+	uint32_t i, n_params;
 	const struct spa_pod *params[1];
 	uint8_t buffer[1024];
 	struct spa_pod_builder b;
 
-	impl->stream = pw_stream_new(impl->core, "Lindroid sink", impl->stream_props);
-	impl->stream_props = NULL;
+	for (i = 0; i < impl->n_playbacks; i++) {
+		pb = &impl->playbacks[i];
+		cycle_stats_init(&pb->stats);
+
+		/* props stay around, the STREAM packet reads them */
+		pb->stream = pw_stream_new(impl->core, "Lindroid sink",
+				pw_properties_copy(pb->props));
+		if (pb->stream == NULL)
+			return -errno;
+
+		pw_stream_add_listener(pb->stream,
+				&pb->listener,
+				&playback_stream_events, pb);
+
+		n_params = 0;
+		spa_pod_builder_init(&b, buffer, sizeof(buffer));
+		params[n_params++] = build_stream_format(impl, &b, &pb->info);
+
+		if ((res = pw_stream_connect(pb->stream,
+				PW_DIRECTION_INPUT,
+				PW_ID_ANY,
+				PW_STREAM_FLAG_AUTOCONNECT |
+				PW_STREAM_FLAG_MAP_BUFFERS |
+				PW_STREAM_FLAG_RT_PROCESS,
+				params, n_params)) < 0)
+			return res;
+	}
+
+	cycle_stats_init(&impl->capture_stats);
 
 	impl->source_stream = pw_stream_new(impl->core, "Lindroid source", impl->source_stream_props);
 	impl->source_stream_props = NULL;
 
-	if (impl->stream == NULL || impl->source_stream == NULL)
+	if (impl->source_stream == NULL)
 		return -errno;
 
-	pw_stream_add_listener(impl->stream,
-			&impl->stream_listener,
-			&playback_stream_events, impl);
-
 	pw_stream_add_listener(impl->source_stream,
 			&impl->source_stream_listener,
 			&input_stream_events, impl);
 
 	n_params = 0;
 	spa_pod_builder_init(&b, buffer, sizeof(buffer));
-	params[n_params++] = spa_format_audio_raw_build(&b,
-			SPA_PARAM_EnumFormat, &impl->info);
+	params[n_params++] = build_stream_format(impl, &b, &impl->source_info);
 
-	if ((res = pw_stream_connect(impl->stream,
-			PW_DIRECTION_INPUT,
+	if ((res = pw_stream_connect(impl->source_stream,
+			PW_DIRECTION_OUTPUT,
 			PW_ID_ANY,
 			PW_STREAM_FLAG_AUTOCONNECT |
 			PW_STREAM_FLAG_MAP_BUFFERS |
-			PW_STREAM_FLAG_RT_PROCESS,
+			PW_STREAM_FLAG_RT_PROCESS |
+			(impl->driver ? PW_STREAM_FLAG_DRIVER : 0),
 			params, n_params)) < 0)
 		return res;
 
-	n_params = 0;
+	if (!impl->aec_reference)
+		return 0;
+
+	impl->aec_stream = pw_stream_new(impl->core, "Lindroid echo reference",
+			impl->aec_stream_props);
+	impl->aec_stream_props = NULL;
+
+	if (impl->aec_stream == NULL)
+		return -errno;
+
+	pw_stream_add_listener(impl->aec_stream,
+			&impl->aec_stream_listener,
+			&reference_stream_events, impl);
+
 	spa_pod_builder_init(&b, buffer, sizeof(buffer));
-	params[n_params++] = spa_format_audio_raw_build(&b,
-			SPA_PARAM_EnumFormat, &impl->source_info);
+	params[0] = spa_format_audio_raw_build(&b, SPA_PARAM_EnumFormat,
+			&impl->playbacks[0].info);
 
-	if ((res = pw_stream_connect(impl->source_stream,
+	if ((res = pw_stream_connect(impl->aec_stream,
 			PW_DIRECTION_OUTPUT,
 			PW_ID_ANY,
 			PW_STREAM_FLAG_AUTOCONNECT |
 			PW_STREAM_FLAG_MAP_BUFFERS |
 			PW_STREAM_FLAG_RT_PROCESS,
-			params, n_params)) < 0)
+			params, 1)) < 0)
 		return res;
 
 	return 0;
 }
 
 
-static int connect_audio_socket(struct impl *impl) {
-	struct sockaddr_un addr;
+/* bytes for msec of info and at least max_rate, the highest rate the ring
+ * may run at later */
+static uint32_t ring_size(struct impl *impl, const struct spa_audio_info_raw *info,
+		uint32_t max_rate, uint32_t msec)
+{
+	uint32_t rate = SPA_MAX(info->rate, max_rate);
+	uint64_t size;
+
+	size = ((uint64_t)msec * rate / 1000 + 2 * impl->max_quantum) *
+		info->channels * sizeof(int32_t);
+	if (size <= MIN_BUFFER_SIZE)
+		return MIN_BUFFER_SIZE;
+	if (size >= MAX_BUFFER_SIZE)
+		return MAX_BUFFER_SIZE;
+	return 1u << (32 - __builtin_clz((uint32_t)size - 1));
+}
 
-	impl->audio_socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
-	if (impl->audio_socket_fd == -1) {
-		pw_log_error("Failed to create audio socket: %m");
+static int setup_rings(struct impl *impl, bool shared)
+{
+	uint32_t i, offset = SPA_ROUND_UP_N(sizeof(struct lindroid_shm_header), 64);
+	uint32_t playback_size, capture_size, size;
+	struct playback_stream *pb;
+	void *p;
+
+	/* the HELLO may change the rates of these */
+	playback_size = ring_size(impl, &impl->playbacks[0].info, MAX_HOST_RATE,
+			SPA_MAX(impl->high_water_msec, impl->playback_target_msec));
+	capture_size = ring_size(impl, &impl->source_info, MAX_HOST_RATE,
+			SPA_MAX(impl->capture_target_msec, impl->capture_max_msec));
+	impl->shm_size = offset + playback_size + capture_size;
+
+	if (shared) {
+		impl->shm_fd = memfd_create("lindroid-audio", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+		if (impl->shm_fd < 0 || ftruncate(impl->shm_fd, impl->shm_size) < 0 ||
+		    fcntl(impl->shm_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+			pw_log_warn("can't create shared memory, using the socket only: %m");
+			if (impl->shm_fd >= 0)
+				close(impl->shm_fd);
+			impl->shm_fd = -1;
+		} else {
+			impl->shm_eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+			if (impl->shm_eventfd < 0)
+				return -errno;
+		}
+	}
+
+	if (impl->shm_fd >= 0)
+		p = mmap(NULL, impl->shm_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED, impl->shm_fd, 0);
+	else
+		p = mmap(NULL, impl->shm_size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
 		return -errno;
+
+	impl->shm = p;
+	pb = &impl->playbacks[0];
+	ring_init(&pb->ring, impl->shm, &impl->shm->playback, offset, playback_size);
+	ring_init(&impl->capture, impl->shm, &impl->shm->capture,
+			offset + playback_size, capture_size);
+
+	/* the other streams only ever go over the socket */
+	for (i = 1; i < impl->n_playbacks; i++) {
+		pb = &impl->playbacks[i];
+		size = ring_size(impl, &pb->info, DEFAULT_RATE,
+				SPA_MAX(impl->high_water_msec, impl->playback_target_msec));
+		pb->local_data = malloc(size);
+		if (pb->local_data == NULL)
+			return -errno;
+		ring_init_local(&pb->ring, &pb->local_rb, pb->local_data, size);
 	}
 
-	memset(&addr, 0, sizeof(struct sockaddr_un));
-	addr.sun_family = AF_UNIX;
-	strncpy(addr.sun_path, AUDIO_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+	for (i = 0; i < impl->n_playbacks; i++) {
+		pb = &impl->playbacks[i];
+		update_high_water(pb);
 
-	if (connect(impl->audio_socket_fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)) == -1) {
-		pw_log_error("Failed to connect to audio socket: %m");
-		close(impl->audio_socket_fd);
-		return -errno;
+		/* for writes that wrap around the ring */
+		if (impl->convert) {
+			pb->scratch = malloc(pb->ring.size);
+			if (pb->scratch == NULL)
+				return -errno;
+		}
+	}
+	if (impl->convert) {
+		impl->capture_scratch = malloc(impl->capture.size);
+		if (impl->capture_scratch == NULL)
+			return -errno;
+	}
+
+	if (impl->aec_reference) {
+		size = ring_size(impl, &impl->playbacks[0].info, MAX_HOST_RATE,
+				AEC_HISTORY_MSEC);
+		impl->aec_data = calloc(1, size);
+		if (impl->aec_data == NULL)
+			return -errno;
+		ring_init_local(&impl->aec_history, &impl->aec_rb, impl->aec_data, size);
 	}
 
 	return 0;
 }
 
-static int bitmap_add(struct bitmap *map, uint32_t i)
+/* index of id, or of where it would go */
+static size_t id_set_find(const struct id_set *set, uint32_t id)
+{
+	size_t lo = 0, hi = set->n_ids, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (set->ids[mid] < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int id_set_add(struct id_set *set, uint32_t id)
 {
-	const uint32_t pos = (i >> 3);
-	const uint8_t mask = 1 << (i & 0x7);
+	size_t i = id_set_find(set, id);
+
+	if (i < set->n_ids && set->ids[i] == id)
+		return 1;
 
-	if (pos >= map->size) {
-		size_t new_size = map->size + pos + 16;
+	if (set->n_ids == set->size) {
+		size_t new_size = SPA_MAX(set->size * 2, (size_t)16);
 		void *p;
 
-		p = realloc(map->data, new_size);
+		p = reallocarray(set->ids, new_size, sizeof(uint32_t));
 		if (!p)
 			return -errno;
 
-		memset((uint8_t*)p + map->size, 0, new_size - map->size);
-		map->data = p;
-		map->size = new_size;
+		set->ids = p;
+		set->size = new_size;
 	}
 
-	if (map->data[pos] & mask)
-		return 1;
-
-	map->data[pos] |= mask;
-	++map->items;
+	memmove(&set->ids[i + 1], &set->ids[i], (set->n_ids - i) * sizeof(uint32_t));
+	set->ids[i] = id;
+	set->n_ids++;
 
 	return 0;
 }
 
-static bool bitmap_remove(struct bitmap *map, uint32_t i)
+static bool id_set_remove(struct id_set *set, uint32_t id)
 {
-	const uint32_t pos = (i >> 3);
-	const uint8_t mask = 1 << (i & 0x7);
-
-	if (pos >= map->size)
-		return false;
+	size_t i = id_set_find(set, id);
 
-	if (!(map->data[pos] & mask))
+	if (i == set->n_ids || set->ids[i] != id)
 		return false;
 
-	map->data[pos] &= ~mask;
-	--map->items;
+	set->n_ids--;
+	memmove(&set->ids[i], &set->ids[i + 1], (set->n_ids - i) * sizeof(uint32_t));
 
 	return true;
 }
 
-static void bitmap_free(struct bitmap *map)
+static void id_set_free(struct id_set *set)
 {
-	free(map->data);
-	spa_zero(*map);
+	free(set->ids);
+	spa_zero(*set);
 }
 
-static int add_id(struct bitmap *map, uint32_t id)
+static int add_id(struct id_set *set, uint32_t id)
 {
 	int res;
 
 	if (id == SPA_ID_INVALID)
 		return -EINVAL;
 
-	if ((res = bitmap_add(map, id)) < 0)
+	if ((res = id_set_add(set, id)) < 0)
 	       pw_log_error("%s", spa_strerror(res));
 
 	return res;
 }
 
+static void on_check_event(void *data, uint64_t count)
+{
+	struct impl *impl = data;
+
+	impl->check_queued = false;
+	if (impl->scheduled && impl->core != NULL)
+		impl->check_seq = pw_core_sync(impl->core, 0, impl->check_seq);
+}
+
+/* push a scheduled check behind the events that are still coming, a whole
+ * burst of them shares one sync */
 static void reschedule_check(struct impl *impl)
 {
-	if (!impl->scheduled)
+	if (!impl->scheduled || impl->check_queued)
 		return;
 
-	impl->check_seq = pw_core_sync(impl->core, 0, impl->check_seq);
+	impl->check_queued = true;
+	pw_loop_signal_event(impl->main_loop, impl->check_event);
 }
 
 static void schedule_check(struct impl *impl)
@@ -424,7 +3750,7 @@ static void schedule_check(struct impl *impl)
 		return;
 
 	impl->scheduled = true;
-	impl->check_seq = pw_core_sync(impl->core, 0, impl->check_seq);
+	reschedule_check(impl);
 }
 
 static void sink_proxy_removed(void *data)
@@ -494,9 +3820,9 @@ static void check_sinks(struct impl *impl)
 	int res;
 
 	pw_log_debug("seeing %zu sink(s), %zu fallback sink(s)",
-			impl->sink_ids.items, impl->fallback_sink_ids.items);
+			impl->sink_ids.n_ids, impl->fallback_sink_ids.n_ids);
 
-	if (impl->sink_ids.items > impl->fallback_sink_ids.items) {
+	if (impl->sink_ids.n_ids > impl->fallback_sink_ids.n_ids) {
 		sink_destroy(impl);
 	} else {
 		if ((res = sink_create(impl)) < 0)
@@ -533,8 +3859,8 @@ static void registry_event_global_remove(void *data, uint32_t id)
 
 	reschedule_check(impl);
 
-	bitmap_remove(&impl->fallback_sink_ids, id);
-	if (bitmap_remove(&impl->sink_ids, id))
+	id_set_remove(&impl->fallback_sink_ids, id);
+	if (id_set_remove(&impl->sink_ids, id))
 		schedule_check(impl);
 }
 
@@ -548,7 +3874,8 @@ static void core_done(void *data, uint32_t id, int seq)
 {
 	struct impl *impl = data;
 
-	if (seq == impl->check_seq) {
+	/* a queued check syncs again, wait for that one */
+	if (seq == impl->check_seq && !impl->check_queued) {
 		impl->scheduled = false;
 		check_sinks(impl);
 	}
@@ -587,12 +3914,69 @@ static const struct pw_proxy_events core_proxy_events = {
 
 static void impl_destroy(struct impl *impl)
 {
+	uint32_t i;
+
 	sink_destroy(impl);
 
-	if (impl->stream)
-		pw_stream_destroy(impl->stream);
+	if (impl->stats_timer)
+		pw_loop_destroy_source(impl->main_loop, impl->stats_timer);
+	if (impl->latency_timer)
+		pw_loop_destroy_source(impl->main_loop, impl->latency_timer);
 
-	pw_properties_free(impl->stream_props);
+	/* the receive thread triggers the source, stop it before the streams
+	 * go and keep the io sources until no RT process can signal them */
+	if (impl->io_thread) {
+		pw_data_loop_stop(impl->io_thread);
+		close_connection(impl);
+	}
+
+	for (i = 0; i < impl->n_playbacks; i++)
+		if (impl->playbacks[i].stream)
+			pw_stream_destroy(impl->playbacks[i].stream);
+	if (impl->source_stream)
+		pw_stream_destroy(impl->source_stream);
+	if (impl->aec_stream)
+		pw_stream_destroy(impl->aec_stream);
+	if (impl->rt_message_event)
+		pw_loop_destroy_source(impl->main_loop, impl->rt_message_event);
+
+	if (impl->io_thread) {
+		if (impl->handshake_timer)
+			pw_loop_destroy_source(impl->io_loop, impl->handshake_timer);
+		if (impl->reconnect_timer)
+			pw_loop_destroy_source(impl->io_loop, impl->reconnect_timer);
+		if (impl->disconnect_event)
+			pw_loop_destroy_source(impl->io_loop, impl->disconnect_event);
+		if (impl->watch_source)
+			pw_loop_destroy_source(impl->io_loop, impl->watch_source);
+		if (impl->driver_timer)
+			pw_loop_destroy_source(impl->io_loop, impl->driver_timer);
+		if (impl->playback_event)
+			pw_loop_destroy_source(impl->io_loop, impl->playback_event);
+		pw_data_loop_destroy(impl->io_thread);
+	}
+	if (impl->watch_fd >= 0)
+		close(impl->watch_fd);
+
+	if (impl->shm)
+		munmap(impl->shm, impl->shm_size);
+	if (impl->shm_fd >= 0)
+		close(impl->shm_fd);
+	if (impl->shm_eventfd >= 0)
+		close(impl->shm_eventfd);
+
+	free_encoders(impl);
+	codec_decoder_free(impl->decoder);
+	codec_decoder_free(impl->decoder_pending);
+	for (i = 0; i < impl->n_playbacks; i++) {
+		free(impl->playbacks[i].scratch);
+		free(impl->playbacks[i].local_data);
+		pw_properties_free(impl->playbacks[i].props);
+	}
+	free(impl->capture_scratch);
+	free(impl->aec_data);
+	pw_properties_free(impl->aec_stream_props);
+	free(impl->socket_path);
 
 	if (impl->registry) {
 		spa_hook_remove(&impl->registry_listener);
@@ -613,8 +3997,11 @@ static void impl_destroy(struct impl *impl)
 		impl->properties = NULL;
 	}
 
-	bitmap_free(&impl->sink_ids);
-	bitmap_free(&impl->fallback_sink_ids);
+	if (impl->check_event)
+		pw_loop_destroy_source(impl->main_loop, impl->check_event);
+
+	id_set_free(&impl->sink_ids);
+	id_set_free(&impl->fallback_sink_ids);
 
 	free(impl);
 }
@@ -626,15 +4013,27 @@ static void module_destroy(void *data)
 	impl_destroy(impl);
 }
 
-static void copy_props(struct impl *impl, struct pw_properties *props, const char *key)
+static void copy_props(struct pw_properties *dst, struct pw_properties *props, const char *key)
 {
 	const char *str;
 	if ((str = pw_properties_get(props, key)) != NULL) {
-		if (pw_properties_get(impl->stream_props, key) == NULL)
-			pw_properties_set(impl->stream_props, key, str);
+		if (pw_properties_get(dst, key) == NULL)
+			pw_properties_set(dst, key, str);
 	}
 }
 
+/* the module wide audio format, for the keys the stream props leave out */
+static void copy_audio_props(struct pw_properties *dst, struct pw_properties *props)
+{
+	/* a position overrides the channel count, so it must not come
+	 * from the module when the stream picked its own channels */
+	if (pw_properties_get(dst, PW_KEY_AUDIO_CHANNELS) == NULL)
+		copy_props(dst, props, SPA_KEY_AUDIO_POSITION);
+	copy_props(dst, props, PW_KEY_AUDIO_FORMAT);
+	copy_props(dst, props, PW_KEY_AUDIO_RATE);
+	copy_props(dst, props, PW_KEY_AUDIO_CHANNELS);
+}
+
 
 static const struct pw_impl_module_events module_events = {
 	PW_VERSION_IMPL_MODULE_EVENTS,
@@ -645,7 +4044,8 @@ static inline uint32_t format_from_name(const char *name, size_t len)
 {
 	int i;
 	for (i = 0; spa_type_audio_format[i].name; i++) {
-		if (strncmp(name, spa_debug_type_short_name(spa_type_audio_format[i].name), len) == 0)
+		const char *short_name = spa_debug_type_short_name(spa_type_audio_format[i].name);
+		if (strlen(short_name) == len && strncmp(name, short_name, len) == 0)
 			return spa_type_audio_format[i].type;
 	}
 	return SPA_AUDIO_FORMAT_UNKNOWN;
@@ -678,32 +4078,211 @@ static void parse_position(struct spa_audio_info_raw *info, const char *val, siz
 }
 
 
-static void parse_audio_info(const struct pw_properties *props, struct spa_audio_info_raw *info)
+static uint32_t get_cpu_flags(struct pw_context *context)
+{
+	const struct spa_support *support;
+	uint32_t n_support;
+	struct spa_cpu *cpu;
+
+	support = pw_context_get_support(context, &n_support);
+	cpu = spa_support_find(support, n_support, SPA_TYPE_INTERFACE_CPU);
+	return cpu ? spa_cpu_get_flags(cpu) : 0;
+}
+
+static enum underrun_fill parse_underrun_fill(const char *str)
+{
+	if (str == NULL || spa_streq(str, "silence"))
+		return UNDERRUN_FILL_SILENCE;
+	if (spa_streq(str, "repeat"))
+		return UNDERRUN_FILL_REPEAT;
+	if (spa_streq(str, "fade"))
+		return UNDERRUN_FILL_FADE;
+
+	pw_log_warn("unknown capture.underrun-fill '%s', using silence", str);
+	return UNDERRUN_FILL_SILENCE;
+}
+
+static enum protocol parse_protocol(const char *str)
+{
+	if (str == NULL || spa_streq(str, "auto"))
+		return PROTOCOL_AUTO;
+	if (spa_streq(str, "framed"))
+		return PROTOCOL_FRAMED;
+	if (spa_streq(str, "legacy"))
+		return PROTOCOL_LEGACY;
+
+	pw_log_warn("unknown socket.protocol '%s', using auto", str);
+	return PROTOCOL_AUTO;
+}
+
+static bool parse_codec(const char *str)
+{
+	if (str == NULL || spa_streq(str, "pcm"))
+		return false;
+	if (spa_streq(str, "opus")) {
+		if (codec_supported(48000, 1))
+			return true;
+		pw_log_warn("built without Opus, sending PCM");
+		return false;
+	}
+
+	pw_log_warn("unknown transport.codec '%s', using pcm", str);
+	return false;
+}
+
+static enum drop_policy parse_drop_policy(const char *str)
+{
+	if (str == NULL || spa_streq(str, "oldest"))
+		return DROP_POLICY_OLDEST;
+	if (spa_streq(str, "newest"))
+		return DROP_POLICY_NEWEST;
+
+	pw_log_warn("unknown playback.drop-policy '%s', using oldest", str);
+	return DROP_POLICY_OLDEST;
+}
+
+static int parse_audio_info(const struct pw_properties *props, struct spa_audio_info_raw *info,
+		const char *default_position)
 {
 	const char *str;
 
 	spa_zero(*info);
-	info->format = format_from_name("S16", strlen("S16"));
-	info->rate = 48000;
+	if ((str = pw_properties_get(props, PW_KEY_AUDIO_FORMAT)) == NULL)
+		str = DEFAULT_FORMAT;
+	info->format = format_from_name(str, strlen(str));
+	if (format_to_lindroid(info->format) == LINDROID_FORMAT_UNKNOWN) {
+		pw_log_error("unsupported audio.format '%s'", str);
+		return -EINVAL;
+	}
+
+	info->rate = pw_properties_get_uint32(props, PW_KEY_AUDIO_RATE, 0);
+	if (info->rate == 0)
+		info->rate = DEFAULT_RATE;
 
-	info->channels = 2;
-	info->channels = 2;
-	parse_position(info, "FL,FR", strlen("FL,FR"));
+	info->channels = pw_properties_get_uint32(props, PW_KEY_AUDIO_CHANNELS, 0);
+	info->channels = SPA_MIN(info->channels, SPA_AUDIO_MAX_CHANNELS);
+	if ((str = pw_properties_get(props, SPA_KEY_AUDIO_POSITION)) != NULL)
+		parse_position(info, str, strlen(str));
+	if (info->channels == 0)
+		parse_position(info, default_position, strlen(default_position));
+
+	return 0;
+}
+
+static void set_audio_props(struct pw_properties *props, const struct spa_audio_info_raw *info);
+
+static void set_latency_props(struct impl *impl, struct pw_properties *props,
+		struct pw_properties *module_args, uint32_t rate)
+{
+	const char *str;
+	uint32_t num, denom;
+
+	copy_props(props, module_args, PW_KEY_NODE_LATENCY);
+	if (impl->low_latency && pw_properties_get(props, PW_KEY_NODE_LATENCY) == NULL)
+		pw_properties_setf(props, PW_KEY_NODE_LATENCY, "%u/%u", LOW_LATENCY_QUANTUM, rate);
+
+	if (!impl->force_quantum || pw_properties_get(props, PW_KEY_NODE_FORCE_QUANTUM) != NULL)
+		return;
+	if ((str = pw_properties_get(props, PW_KEY_NODE_LATENCY)) != NULL &&
+	    sscanf(str, "%u/%u", &num, &denom) == 2 && num > 0)
+		pw_properties_setf(props, PW_KEY_NODE_FORCE_QUANTUM, "%u", num);
+}
+
+static int init_playback(struct impl *impl, struct pw_properties *module_args,
+		const char *extra, size_t len, const char *name, const char *description,
+		const char *group)
+{
+	struct playback_stream *pb = &impl->playbacks[impl->n_playbacks];
+	struct pw_properties *props;
+	int res;
+
+	pb->impl = impl;
+	pb->id = impl->n_playbacks++;
+	/* until the graph starts it, the host has nothing to play */
+	pb->paused = true;
+	pb->props = props = pw_properties_new(NULL, NULL);
+	if (props == NULL)
+		return -errno;
+
+	if (pb->id == 0) {
+		pw_properties_setf(props, PW_KEY_NODE_NAME, "%s Sink", name);
+		pw_properties_setf(props, PW_KEY_NODE_DESCRIPTION, "%s output", description);
+	} else {
+		pw_properties_setf(props, PW_KEY_NODE_NAME, "%s Sink %u", name, pb->id);
+		pw_properties_setf(props, PW_KEY_NODE_DESCRIPTION, "%s output %u",
+				description, pb->id);
+	}
+	pw_properties_set(props, PW_KEY_MEDIA_CLASS, "Audio/Sink");
+	pw_properties_set(props, PW_KEY_FACTORY_NAME, "support.null-audio-sink");
+	pw_properties_set(props, PW_KEY_NODE_VIRTUAL, "false");
+	pw_properties_set(props, "monitor.channel-volumes", "true");
+
+	if (extra != NULL)
+		pw_properties_update_string(props, extra, len);
+
+	copy_audio_props(props, module_args);
+
+	if ((res = parse_audio_info(props, &pb->info, DEFAULT_POSITION)) < 0)
+		return res;
+
+	set_audio_props(props, &pb->info);
+	set_latency_props(impl, props, module_args, pb->info.rate);
+
+	if (group != NULL && pw_properties_get(props, PW_KEY_NODE_GROUP) == NULL)
+		pw_properties_set(props, PW_KEY_NODE_GROUP, group);
+
+	return 0;
 }
 
-static void parse_audio_info_mic(const struct pw_properties *props, struct spa_audio_info_raw *info)
+static int parse_playback_streams(struct impl *impl, struct pw_properties *module_args,
+		const char *name, const char *description, const char *group)
 {
-        const char *str;
+	struct spa_json it[2];
+	const char *str, *val;
+	int len, res;
 
-        spa_zero(*info);
-        info->format = format_from_name("S16", strlen("S16"));
-        info->rate = 48000;
+	if ((str = pw_properties_get(module_args, "playback.streams")) == NULL)
+		return 0;
+
+	spa_json_init(&it[0], str, strlen(str));
+	if (spa_json_enter_array(&it[0], &it[1]) <= 0) {
+		pw_log_error("playback.streams must be an array");
+		return -EINVAL;
+	}
 
-        info->channels = 1;
-        info->channels = 1;
-        parse_position(info, "MONO", strlen("MONO"));
+	while ((len = spa_json_next(&it[1], &val)) > 0) {
+		if (!spa_json_is_object(val, len)) {
+			pw_log_error("playback.streams entries must be objects");
+			return -EINVAL;
+		}
+		if (impl->n_playbacks == MAX_PLAYBACK_STREAMS) {
+			pw_log_error("at most %d playback.streams", MAX_PLAYBACK_STREAMS - 1);
+			return -EINVAL;
+		}
+		len = spa_json_container_len(&it[1], val, len);
+
+		if ((res = init_playback(impl, module_args, val, len,
+						name, description, group)) < 0)
+			return res;
+	}
+	return 0;
 }
 
+static void set_audio_props(struct pw_properties *props, const struct spa_audio_info_raw *info)
+{
+	char pos[SPA_AUDIO_MAX_CHANNELS * 8];
+	uint32_t i, len = 0;
+
+	pos[0] = '\0';
+	for (i = 0; i < info->channels; i++)
+		len += spa_scnprintf(pos + len, sizeof(pos) - len, "%s%s", i ? "," : "",
+				spa_debug_type_find_short_name(spa_type_audio_channel,
+					info->position[i]));
+
+	pw_properties_setf(props, SPA_KEY_AUDIO_RATE, "%u", info->rate);
+	pw_properties_setf(props, SPA_KEY_AUDIO_CHANNELS, "%u", info->channels);
+	pw_properties_set(props, SPA_KEY_AUDIO_POSITION, pos);
+}
 
 SPA_EXPORT
 int pipewire__module_init(struct pw_impl_module *module, const char *args)
@@ -711,8 +4290,10 @@ int pipewire__module_init(struct pw_impl_module *module, const char *args)
 	struct pw_context *context = pw_impl_module_get_context(module);
 	struct pw_properties *props = NULL;
 	struct pw_properties *source_props = NULL;
+	struct pw_properties *module_args = NULL;
 	struct impl *impl = NULL;
-	const char *str;
+	const char *str, *name, *description, *group = NULL;
+	char group_name[256];
 	int res;
 
 	PW_LOG_TOPIC_INIT(mod_topic);
@@ -725,6 +4306,93 @@ int pipewire__module_init(struct pw_impl_module *module, const char *args)
 
 	impl->module = module;
 	impl->context = context;
+	impl->main_loop = pw_context_get_main_loop(context);
+	impl->data_loop = pw_data_loop_get_loop(pw_context_get_data_loop(context));
+	impl->host_rate_diff = 1.0;
+	impl->audio_socket_fd = -1;
+	impl->watch_fd = -1;
+	impl->shm_fd = -1;
+	impl->shm_eventfd = -1;
+
+	if (args == NULL)
+		args = "";
+
+	module_args = pw_properties_new_string(args);
+	if (module_args == NULL) {
+		res = -errno;
+		pw_log_error( "can't create properties: %m");
+		goto error;
+	}
+
+	impl->underrun_fill = parse_underrun_fill(
+			pw_properties_get(module_args, "capture.underrun-fill"));
+	impl->drop_policy = parse_drop_policy(
+			pw_properties_get(module_args, "playback.drop-policy"));
+	impl->protocol_config = parse_protocol(
+			pw_properties_get(module_args, "socket.protocol"));
+	impl->socket_sndbuf = SPA_MIN(pw_properties_get_uint32(module_args,
+				"socket.sndbuf", 0), (uint32_t)INT32_MAX);
+	impl->socket_rcvbuf = SPA_MIN(pw_properties_get_uint32(module_args,
+				"socket.rcvbuf", 0), (uint32_t)INT32_MAX);
+	impl->codec_offer = parse_codec(pw_properties_get(module_args, "transport.codec"));
+	impl->suspend_msec = pw_properties_get_uint32(module_args,
+			"suspend.silence.msec", 0);
+	impl->capture_lazy = pw_properties_get_bool(module_args, "capture.lazy", true);
+	impl->capture_paused = impl->capture_lazy;
+	impl->codec_bitrate = pw_properties_get_uint32(module_args,
+			"transport.codec.bitrate", DEFAULT_CODEC_BITRATE);
+
+	if ((str = pw_properties_get(module_args, "socket.path")) == NULL)
+		str = DEFAULT_SOCKET_PATH;
+	if (strlen(str) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+		res = -ENAMETOOLONG;
+		pw_log_error("socket.path '%s' is too long", str);
+		goto error;
+	}
+	impl->socket_path = strdup(str);
+	if (impl->socket_path == NULL) {
+		res = -errno;
+		goto error;
+	}
+
+	if ((name = pw_properties_get(module_args, PW_KEY_NODE_NAME)) == NULL)
+		name = DEFAULT_NAME;
+	if ((description = pw_properties_get(module_args, PW_KEY_NODE_DESCRIPTION)) == NULL)
+		description = DEFAULT_DESCRIPTION;
+
+	impl->driver = pw_properties_get_bool(module_args, PW_KEY_NODE_DRIVER, false);
+	impl->rate_match = pw_properties_get_bool(module_args, "audio.rate-match", true);
+	if ((str = pw_properties_get(module_args, "latency.profile")) != NULL) {
+		if (spa_streq(str, "low-latency"))
+			impl->low_latency = true;
+		else if (!spa_streq(str, "default"))
+			pw_log_warn("unknown latency.profile '%s', using default", str);
+	}
+	impl->force_quantum = pw_properties_get_bool(module_args, "latency.force-quantum", false);
+
+	impl->playback_target_msec = pw_properties_get_uint32(module_args,
+			"playback.target-latency.msec", impl->low_latency ?
+			LOW_LATENCY_TARGET_MSEC : DEFAULT_TARGET_LATENCY_MSEC);
+	impl->capture_target_msec = pw_properties_get_uint32(module_args,
+			"capture.target-latency.msec", impl->low_latency ?
+			LOW_LATENCY_TARGET_MSEC : DEFAULT_TARGET_LATENCY_MSEC);
+	impl->capture_max_msec = pw_properties_get_uint32(module_args,
+			"capture.max-latency.msec", 3 * impl->capture_target_msec);
+	if (impl->capture_max_msec > 0 &&
+	    impl->capture_max_msec < 2 * impl->capture_target_msec) {
+		pw_log_warn("capture.max-latency.msec below twice the target, using %u",
+				2 * impl->capture_target_msec);
+		impl->capture_max_msec = 2 * impl->capture_target_msec;
+	}
+	impl->capture_adaptive = pw_properties_get_bool(module_args,
+			"capture.jitter.adaptive", true);
+
+	impl->convert = pw_properties_get_bool(module_args, "audio.convert", true);
+	if (impl->convert)
+		format_ops_init(&impl->ops, get_cpu_flags(impl->context));
+
+	impl->max_quantum = pw_properties_get_uint32(pw_context_get_properties(context),
+			"default.clock.max-quantum", DEFAULT_MAX_QUANTUM);
 
 	props = pw_properties_new(NULL, NULL);
 	if (props == NULL) {
@@ -742,13 +4410,6 @@ int pipewire__module_init(struct pw_impl_module *module, const char *args)
 	}
 	impl->source_properties = source_props;
 
-	impl->stream_props = pw_properties_new(NULL, NULL);
-	if (impl->stream_props == NULL) {
-		res = -errno;
-		pw_log_error( "can't create properties: %m");
-		goto error;
-	}
-
 	impl->source_stream_props = pw_properties_new(NULL, NULL);
 	if (impl->source_stream_props == NULL) {
 		res = -errno;
@@ -756,59 +4417,99 @@ int pipewire__module_init(struct pw_impl_module *module, const char *args)
 		goto error;
 	}
 
-	pw_properties_set(props, PW_KEY_NODE_NAME, "Lindroid Sink");
-	pw_properties_set(props, PW_KEY_NODE_DESCRIPTION, "Lindroid audio output");
-
-    // TBD: Do not assume channel count/location
-	pw_properties_setf(props, SPA_KEY_AUDIO_RATE, "%u", 48000);
-	pw_properties_setf(props, SPA_KEY_AUDIO_CHANNELS, "%u", 2);
-	pw_properties_set(props, SPA_KEY_AUDIO_POSITION, "FL,FR");
-
+	pw_properties_setf(props, PW_KEY_NODE_NAME, "%s Sink", name);
+	pw_properties_setf(props, PW_KEY_NODE_DESCRIPTION, "%s output", description);
 	pw_properties_set(props, PW_KEY_MEDIA_CLASS, "Audio/Sink");
 	pw_properties_set(props, PW_KEY_FACTORY_NAME, "support.null-audio-sink");
 	pw_properties_set(props, PW_KEY_NODE_VIRTUAL, "false");
 	pw_properties_set(props, "monitor.channel-volumes", "true");
 
-	pw_properties_set(impl->stream_props, PW_KEY_NODE_NAME, "Lindroid Sink");
-	pw_properties_set(impl->stream_props, PW_KEY_NODE_DESCRIPTION, "Lindroid audio output");
-
-    // TBD: Do not assume channel count/location
-	pw_properties_setf(impl->stream_props, SPA_KEY_AUDIO_RATE, "%u", 48000);
-	pw_properties_setf(impl->stream_props, SPA_KEY_AUDIO_CHANNELS, "%u", 2);
-	pw_properties_set(impl->stream_props, SPA_KEY_AUDIO_POSITION, "FL,FR");
-
-	pw_properties_set(impl->stream_props, PW_KEY_MEDIA_CLASS, "Audio/Sink");
-	pw_properties_set(impl->stream_props, PW_KEY_FACTORY_NAME, "support.null-audio-sink");
-	pw_properties_set(impl->stream_props, PW_KEY_NODE_VIRTUAL, "false");
-	pw_properties_set(impl->stream_props, "monitor.channel-volumes", "true");
-
-	parse_audio_info(impl->stream_props, &impl->info);
+	impl->high_water_msec = pw_properties_get_uint32(module_args,
+			"playback.high-water.msec", impl->low_latency ?
+			LOW_LATENCY_HIGH_WATER_MSEC : DEFAULT_HIGH_WATER_MSEC);
+	impl->batch_periods = SPA_MAX(pw_properties_get_uint32(module_args,
+				"playback.batch.periods", 1), 1u);
+	impl->batch_bytes = pw_properties_get_uint32(module_args,
+			"playback.batch.bytes", 0);
+
+	impl->aec_reference = pw_properties_get_bool(module_args, "aec.reference", false);
+
+	if (impl->driver || impl->aec_reference) {
+		/* every sink follows the host clock through the source, and
+		 * the echo reference only lines up within one graph */
+		if ((group = pw_properties_get(module_args, PW_KEY_NODE_GROUP)) == NULL) {
+			snprintf(group_name, sizeof(group_name), "lindroid.%s", name);
+			group = group_name;
+		}
+	}
 
+	str = pw_properties_get(module_args, "sink.props");
+	if ((res = init_playback(impl, module_args, str, str ? strlen(str) : 0,
+					name, description, group)) < 0)
+		goto error;
+	if ((res = parse_playback_streams(impl, module_args, name, description, group)) < 0)
+		goto error;
 
-	// TBD: Do not assume channel count/location
-	pw_properties_setf(source_props, SPA_KEY_AUDIO_RATE, "%u", 48000);
-	pw_properties_setf(source_props, SPA_KEY_AUDIO_CHANNELS, "%u", 1);
-	pw_properties_set(source_props, SPA_KEY_AUDIO_POSITION, "MONO");
+	set_audio_props(props, &impl->playbacks[0].info);
 
 	pw_properties_set(source_props, PW_KEY_MEDIA_CLASS, "Audio/Source");
 	pw_properties_set(source_props, PW_KEY_FACTORY_NAME, "support.null-audio-source");
 	pw_properties_set(source_props, PW_KEY_NODE_VIRTUAL, "false");
 	pw_properties_set(source_props, "monitor.channel-volumes", "true");
 
-	pw_properties_set(impl->source_stream_props, PW_KEY_NODE_NAME, "Lindroid Source");
-	pw_properties_set(impl->source_stream_props, PW_KEY_NODE_DESCRIPTION, "Lindroid audio input");
-
-    // TBD: Do not assume channel count/location
-	pw_properties_setf(impl->source_stream_props, SPA_KEY_AUDIO_RATE, "%u", 48000);
-	pw_properties_setf(impl->source_stream_props, SPA_KEY_AUDIO_CHANNELS, "%u", 1);
-	pw_properties_set(impl->source_stream_props, SPA_KEY_AUDIO_POSITION, "MONO");
-
+	pw_properties_setf(impl->source_stream_props, PW_KEY_NODE_NAME, "%s Source", name);
+	pw_properties_setf(impl->source_stream_props, PW_KEY_NODE_DESCRIPTION, "%s input", description);
 	pw_properties_set(impl->source_stream_props, PW_KEY_MEDIA_CLASS, "Audio/Source");
 	pw_properties_set(impl->source_stream_props, PW_KEY_FACTORY_NAME, "support.null-audio-source");
 	pw_properties_set(impl->source_stream_props, PW_KEY_NODE_VIRTUAL, "false");
 	pw_properties_set(impl->source_stream_props, "monitor.channel-volumes", "true");
 
-	parse_audio_info_mic(impl->source_stream_props, &impl->source_info);
+	if ((str = pw_properties_get(module_args, "source.props")) != NULL)
+		pw_properties_update_string(impl->source_stream_props, str, strlen(str));
+
+	copy_audio_props(impl->source_stream_props, module_args);
+
+	if ((res = parse_audio_info(impl->source_stream_props, &impl->source_info,
+					DEFAULT_SOURCE_POSITION)) < 0)
+		goto error;
+
+	set_audio_props(source_props, &impl->source_info);
+	set_audio_props(impl->source_stream_props, &impl->source_info);
+	set_latency_props(impl, impl->source_stream_props, module_args,
+			impl->source_info.rate);
+
+	publish_capture_format(impl);
+	reset_rate_match(impl);
+
+	if ((res = setup_rings(impl, pw_properties_get_bool(module_args,
+					"transport.shm", true))) < 0) {
+		pw_log_error("can't allocate audio rings: %s", spa_strerror(res));
+		goto error;
+	}
+
+	if (group != NULL) {
+		if (pw_properties_get(impl->source_stream_props, PW_KEY_NODE_GROUP) == NULL)
+			pw_properties_set(impl->source_stream_props, PW_KEY_NODE_GROUP, group);
+		if (pw_properties_get(impl->source_stream_props, PW_KEY_PRIORITY_DRIVER) == NULL)
+			pw_properties_set(impl->source_stream_props, PW_KEY_PRIORITY_DRIVER, "2000");
+	}
+
+	if (impl->aec_reference) {
+		impl->aec_stream_props = pw_properties_new(NULL, NULL);
+		if (impl->aec_stream_props == NULL) {
+			res = -errno;
+			pw_log_error( "can't create properties: %m");
+			goto error;
+		}
+		pw_properties_setf(impl->aec_stream_props, PW_KEY_NODE_NAME,
+				"%s Echo Reference", name);
+		pw_properties_setf(impl->aec_stream_props, PW_KEY_NODE_DESCRIPTION,
+				"%s echo reference", description);
+		pw_properties_set(impl->aec_stream_props, PW_KEY_MEDIA_CLASS, "Audio/Source");
+		pw_properties_set(impl->aec_stream_props, PW_KEY_NODE_VIRTUAL, "true");
+		pw_properties_set(impl->aec_stream_props, PW_KEY_NODE_GROUP, group);
+		set_audio_props(impl->aec_stream_props, &impl->playbacks[0].info);
+	}
 
 	impl->core = pw_context_get_object(impl->context, PW_TYPE_INTERFACE_Core);
 	if (impl->core == NULL) {
@@ -832,6 +4533,10 @@ int pipewire__module_init(struct pw_impl_module *module, const char *args)
 
 	pw_core_add_listener(impl->core, &impl->core_listener, &core_events, impl);
 
+	impl->check_event = pw_loop_add_event(impl->main_loop, on_check_event, impl);
+	if (impl->check_event == NULL)
+		goto error_errno;
+
 	impl->registry = pw_core_get_registry(impl->core,
 			PW_VERSION_REGISTRY, 0);
 	if (impl->registry == NULL)
@@ -847,24 +4552,29 @@ int pipewire__module_init(struct pw_impl_module *module, const char *args)
 
 	schedule_check(impl);
 
-	if ((res = connect_audio_socket(impl)) < 0)
+	if ((res = start_stats_timer(impl)) < 0)
+		goto error;
+
+	if ((res = start_latency_timer(impl)) < 0)
+		goto error;
+
+	if ((res = setup_io_thread(impl)) < 0)
 		goto error;
 
 	if ((res = create_stream(impl)) < 0)
 		goto error;
 
-	// Start socket recieve thread
-	pthread_t thread_id;
-	if (pthread_create(&thread_id, NULL, socket_receive_thread, impl) != 0) {
-		pw_log_error("Failed to create socket receive thread");
+	if ((res = start_io_thread(impl)) < 0)
 		goto error;
-	}
+
+	pw_properties_free(module_args);
 
 	return 0;
 
 error_errno:
 	res = -errno;
 error:
+	pw_properties_free(module_args);
 	if (impl)
 		impl_destroy(impl);
 	return 0;
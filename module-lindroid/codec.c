@@ -0,0 +1,146 @@
+/* Lindroid transport codecs */
+/* SPDX-FileCopyrightText: Copyright © 2024 Lindroid project */
+/* SPDX-License-Identifier: MIT */
+
+#include <errno.h>
+#include <stdlib.h>
+
+#if defined(HAVE_OPUS)
+#include <opus.h>
+#endif
+
+#include "codec.h"
+
+#if defined(HAVE_OPUS)
+
+struct codec_encoder {
+	OpusEncoder *opus;
+	uint32_t channels;
+};
+
+struct codec_decoder {
+	OpusDecoder *opus;
+	uint32_t channels;
+};
+
+bool codec_supported(uint32_t rate, uint32_t channels)
+{
+	switch (rate) {
+	case 8000: case 12000: case 16000: case 24000: case 48000:
+		return channels > 0 && channels <= LINDROID_CODEC_MAX_CHANNELS;
+	default:
+		return false;
+	}
+}
+
+struct codec_encoder *codec_encoder_new(uint32_t rate, uint32_t channels,
+		uint32_t bitrate, bool voice)
+{
+	struct codec_encoder *enc;
+	int err;
+
+	if ((enc = calloc(1, sizeof(*enc))) == NULL)
+		return NULL;
+
+	enc->channels = channels;
+	enc->opus = opus_encoder_create(rate, channels, voice ?
+			OPUS_APPLICATION_VOIP : OPUS_APPLICATION_AUDIO, &err);
+	if (enc->opus == NULL) {
+		free(enc);
+		errno = err == OPUS_ALLOC_FAIL ? ENOMEM : EINVAL;
+		return NULL;
+	}
+	if (bitrate > 0)
+		opus_encoder_ctl(enc->opus, OPUS_SET_BITRATE(bitrate));
+	return enc;
+}
+
+void codec_encoder_free(struct codec_encoder *enc)
+{
+	if (enc == NULL)
+		return;
+	opus_encoder_destroy(enc->opus);
+	free(enc);
+}
+
+int codec_encode(struct codec_encoder *enc, const int16_t *pcm, uint32_t n_frames,
+		uint8_t *data, uint32_t max_size)
+{
+	int res = opus_encode(enc->opus, pcm, n_frames, data, max_size);
+	return res < 0 ? -EINVAL : res;
+}
+
+struct codec_decoder *codec_decoder_new(uint32_t rate, uint32_t channels)
+{
+	struct codec_decoder *dec;
+	int err;
+
+	if ((dec = calloc(1, sizeof(*dec))) == NULL)
+		return NULL;
+
+	dec->channels = channels;
+	dec->opus = opus_decoder_create(rate, channels, &err);
+	if (dec->opus == NULL) {
+		free(dec);
+		errno = err == OPUS_ALLOC_FAIL ? ENOMEM : EINVAL;
+		return NULL;
+	}
+	return dec;
+}
+
+void codec_decoder_free(struct codec_decoder *dec)
+{
+	if (dec == NULL)
+		return;
+	opus_decoder_destroy(dec->opus);
+	free(dec);
+}
+
+int codec_decode(struct codec_decoder *dec, const uint8_t *data, uint32_t size,
+		int16_t *pcm, uint32_t max_frames)
+{
+	int res = opus_decode(dec->opus, data, size, pcm, max_frames, 0);
+	return res < 0 ? -EINVAL : res;
+}
+
+#else /* HAVE_OPUS */
+
+bool codec_supported(uint32_t rate, uint32_t channels)
+{
+	return false;
+}
+
+struct codec_encoder *codec_encoder_new(uint32_t rate, uint32_t channels,
+		uint32_t bitrate, bool voice)
+{
+	errno = ENOTSUP;
+	return NULL;
+}
+
+void codec_encoder_free(struct codec_encoder *enc)
+{
+}
+
+int codec_encode(struct codec_encoder *enc, const int16_t *pcm, uint32_t n_frames,
+		uint8_t *data, uint32_t max_size)
+{
+	return -ENOTSUP;
+}
+
+struct codec_decoder *codec_decoder_new(uint32_t rate, uint32_t channels)
+{
+	errno = ENOTSUP;
+	return NULL;
+}
+
+void codec_decoder_free(struct codec_decoder *dec)
+{
+}
+
+int codec_decode(struct codec_decoder *dec, const uint8_t *data, uint32_t size,
+		int16_t *pcm, uint32_t max_frames)
+{
+	return -ENOTSUP;
+}
+
+#endif /* HAVE_OPUS */
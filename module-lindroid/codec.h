@@ -0,0 +1,54 @@
+/* Lindroid transport codecs */
+/* SPDX-FileCopyrightText: Copyright © 2024 Lindroid project */
+/* SPDX-License-Identifier: MIT */
+
+#ifndef LINDROID_CODEC_H
+#define LINDROID_CODEC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Optional compression of the socket audio for hosts behind a slow link.
+ * Opus is the only codec, available when the module was built with libopus.
+ * It takes interleaved S16 at 8, 12, 16, 24 or 48 kHz with one or two
+ * channels, every packet holds one frame of LINDROID_CODEC_FRAME_MSEC.
+ */
+#define LINDROID_CODEC_FRAME_MSEC	10
+/** largest frame the encoder produces, in frames per channel */
+#define LINDROID_CODEC_MAX_FRAMES	(48000 * LINDROID_CODEC_FRAME_MSEC / 1000)
+/** largest frame a packet may decode to, 120 ms at 48 kHz */
+#define LINDROID_CODEC_MAX_DECODE	5760
+/** largest encoded packet, as recommended by libopus */
+#define LINDROID_CODEC_MAX_PACKET	4000
+#define LINDROID_CODEC_MAX_CHANNELS	2
+
+struct codec_encoder;
+struct codec_decoder;
+
+/** Whether the codec was built in and takes this rate and channel count */
+bool codec_supported(uint32_t rate, uint32_t channels);
+
+/** voice tunes the encoder for speech. NULL with errno set on failure. */
+struct codec_encoder *codec_encoder_new(uint32_t rate, uint32_t channels,
+		uint32_t bitrate, bool voice);
+void codec_encoder_free(struct codec_encoder *enc);
+/** Returns the size of the packet in data, or a negative errno */
+int codec_encode(struct codec_encoder *enc, const int16_t *pcm, uint32_t n_frames,
+		uint8_t *data, uint32_t max_size);
+
+struct codec_decoder *codec_decoder_new(uint32_t rate, uint32_t channels);
+void codec_decoder_free(struct codec_decoder *dec);
+/** Returns the number of frames written to pcm, or a negative errno */
+int codec_decode(struct codec_decoder *dec, const uint8_t *data, uint32_t size,
+		int16_t *pcm, uint32_t max_frames);
+
+#ifdef __cplusplus
+}  /* extern "C" */
+#endif
+
+#endif /* LINDROID_CODEC_H */
@@ -0,0 +1,85 @@
+/* Lindroid sample format conversion */
+/* SPDX-FileCopyrightText: Copyright © 2024 Lindroid project */
+/* SPDX-License-Identifier: MIT */
+
+#include <arm_neon.h>
+
+#include "format-ops.h"
+
+/* mono and stereo are vectorized, other layouts are rare enough to take the
+ * scalar path. Built for aarch64 only, where vcvtnq rounds to nearest even
+ * like the scalar code. */
+
+static inline int16x4_t f32_to_s16x4(float32x4_t v)
+{
+	/* clip first, saturating the scaled value would let -1.0 reach -32768 */
+	v = vminq_f32(vmaxq_f32(v, vdupq_n_f32(-1.0f)), vdupq_n_f32(1.0f));
+	return vqmovn_s32(vcvtnq_s32_f32(vmulq_n_f32(v, LINDROID_S16_SCALE)));
+}
+
+static inline float32x4_t s16x4_to_f32(int16x4_t v)
+{
+	return vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(v)), 1.0f / LINDROID_S16_SCALE);
+}
+
+void conv_f32d_to_s16_neon(void *dst[], const void *src[], uint32_t n_channels, uint32_t n_frames)
+{
+	const float *s0 = src[0], *s1 = n_channels > 1 ? src[1] : NULL;
+	int16_t *d = dst[0];
+	int16x4x2_t out;
+	uint32_t n = 0;
+
+	switch (n_channels) {
+	case 1:
+		for (; n + 4 <= n_frames; n += 4)
+			vst1_s16(&d[n], f32_to_s16x4(vld1q_f32(&s0[n])));
+		for (; n < n_frames; n++)
+			d[n] = lindroid_f32_to_s16(s0[n]);
+		break;
+	case 2:
+		for (; n + 4 <= n_frames; n += 4) {
+			out.val[0] = f32_to_s16x4(vld1q_f32(&s0[n]));
+			out.val[1] = f32_to_s16x4(vld1q_f32(&s1[n]));
+			vst2_s16(&d[2 * n], out);
+		}
+		for (; n < n_frames; n++) {
+			d[2 * n] = lindroid_f32_to_s16(s0[n]);
+			d[2 * n + 1] = lindroid_f32_to_s16(s1[n]);
+		}
+		break;
+	default:
+		conv_f32d_to_s16_c(dst, src, n_channels, n_frames);
+		break;
+	}
+}
+
+void conv_s16_to_f32d_neon(void *dst[], const void *src[], uint32_t n_channels, uint32_t n_frames)
+{
+	const int16_t *s = src[0];
+	float *d0 = dst[0], *d1 = n_channels > 1 ? dst[1] : NULL;
+	int16x4x2_t in;
+	uint32_t n = 0;
+
+	switch (n_channels) {
+	case 1:
+		for (; n + 4 <= n_frames; n += 4)
+			vst1q_f32(&d0[n], s16x4_to_f32(vld1_s16(&s[n])));
+		for (; n < n_frames; n++)
+			d0[n] = lindroid_s16_to_f32(s[n]);
+		break;
+	case 2:
+		for (; n + 4 <= n_frames; n += 4) {
+			in = vld2_s16(&s[2 * n]);
+			vst1q_f32(&d0[n], s16x4_to_f32(in.val[0]));
+			vst1q_f32(&d1[n], s16x4_to_f32(in.val[1]));
+		}
+		for (; n < n_frames; n++) {
+			d0[n] = lindroid_s16_to_f32(s[2 * n]);
+			d1[n] = lindroid_s16_to_f32(s[2 * n + 1]);
+		}
+		break;
+	default:
+		conv_s16_to_f32d_c(dst, src, n_channels, n_frames);
+		break;
+	}
+}
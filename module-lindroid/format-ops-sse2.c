@@ -0,0 +1,95 @@
+/* Lindroid sample format conversion */
+/* SPDX-FileCopyrightText: Copyright © 2024 Lindroid project */
+/* SPDX-License-Identifier: MIT */
+
+#include <emmintrin.h>
+
+#include "format-ops.h"
+
+/* mono and stereo are vectorized, other layouts are rare enough to take the
+ * scalar path */
+
+#define F32_TO_S32(s,lo,hi,scale)	\
+	_mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(s), lo), hi), scale))
+
+void conv_f32d_to_s16_sse2(void *dst[], const void *src[], uint32_t n_channels, uint32_t n_frames)
+{
+	const float *s0 = src[0], *s1 = n_channels > 1 ? src[1] : NULL;
+	int16_t *d = dst[0];
+	const __m128 scale = _mm_set1_ps(LINDROID_S16_SCALE);
+	const __m128 lo = _mm_set1_ps(-1.0f), hi = _mm_set1_ps(1.0f);
+	__m128i l, r;
+	uint32_t n = 0;
+
+	switch (n_channels) {
+	case 1:
+		for (; n + 8 <= n_frames; n += 8) {
+			l = _mm_packs_epi32(
+				F32_TO_S32(&s0[n], lo, hi, scale),
+				F32_TO_S32(&s0[n + 4], lo, hi, scale));
+			_mm_storeu_si128((__m128i *)&d[n], l);
+		}
+		for (; n < n_frames; n++)
+			d[n] = lindroid_f32_to_s16(s0[n]);
+		break;
+	case 2:
+		for (; n + 8 <= n_frames; n += 8) {
+			l = _mm_packs_epi32(
+				F32_TO_S32(&s0[n], lo, hi, scale),
+				F32_TO_S32(&s0[n + 4], lo, hi, scale));
+			r = _mm_packs_epi32(
+				F32_TO_S32(&s1[n], lo, hi, scale),
+				F32_TO_S32(&s1[n + 4], lo, hi, scale));
+			_mm_storeu_si128((__m128i *)&d[2 * n], _mm_unpacklo_epi16(l, r));
+			_mm_storeu_si128((__m128i *)&d[2 * n + 8], _mm_unpackhi_epi16(l, r));
+		}
+		for (; n < n_frames; n++) {
+			d[2 * n] = lindroid_f32_to_s16(s0[n]);
+			d[2 * n + 1] = lindroid_f32_to_s16(s1[n]);
+		}
+		break;
+	default:
+		conv_f32d_to_s16_c(dst, src, n_channels, n_frames);
+		break;
+	}
+}
+
+void conv_s16_to_f32d_sse2(void *dst[], const void *src[], uint32_t n_channels, uint32_t n_frames)
+{
+	const int16_t *s = src[0];
+	float *d0 = dst[0], *d1 = n_channels > 1 ? dst[1] : NULL;
+	const __m128 scale = _mm_set1_ps(1.0f / LINDROID_S16_SCALE);
+	__m128i in;
+	uint32_t n = 0;
+
+	switch (n_channels) {
+	case 1:
+		for (; n + 8 <= n_frames; n += 8) {
+			in = _mm_loadu_si128((const __m128i *)&s[n]);
+			/* sign extend by moving each sample into the top half */
+			_mm_storeu_ps(&d0[n], _mm_mul_ps(_mm_cvtepi32_ps(
+				_mm_srai_epi32(_mm_unpacklo_epi16(in, in), 16)), scale));
+			_mm_storeu_ps(&d0[n + 4], _mm_mul_ps(_mm_cvtepi32_ps(
+				_mm_srai_epi32(_mm_unpackhi_epi16(in, in), 16)), scale));
+		}
+		for (; n < n_frames; n++)
+			d0[n] = lindroid_s16_to_f32(s[n]);
+		break;
+	case 2:
+		for (; n + 4 <= n_frames; n += 4) {
+			in = _mm_loadu_si128((const __m128i *)&s[2 * n]);
+			_mm_storeu_ps(&d0[n], _mm_mul_ps(_mm_cvtepi32_ps(
+				_mm_srai_epi32(_mm_slli_epi32(in, 16), 16)), scale));
+			_mm_storeu_ps(&d1[n], _mm_mul_ps(_mm_cvtepi32_ps(
+				_mm_srai_epi32(in, 16)), scale));
+		}
+		for (; n < n_frames; n++) {
+			d0[n] = lindroid_s16_to_f32(s[2 * n]);
+			d1[n] = lindroid_s16_to_f32(s[2 * n + 1]);
+		}
+		break;
+	default:
+		conv_s16_to_f32d_c(dst, src, n_channels, n_frames);
+		break;
+	}
+}
@@ -0,0 +1,51 @@
+/* Lindroid sample format conversion */
+/* SPDX-FileCopyrightText: Copyright © 2024 Lindroid project */
+/* SPDX-License-Identifier: MIT */
+
+#include <spa/support/cpu.h>
+
+#include "format-ops.h"
+
+void conv_f32d_to_s16_c(void *dst[], const void *src[], uint32_t n_channels, uint32_t n_frames)
+{
+	const float **s = (const float **)src;
+	int16_t *d = dst[0];
+	uint32_t i, c;
+
+	for (i = 0; i < n_frames; i++)
+		for (c = 0; c < n_channels; c++)
+			*d++ = lindroid_f32_to_s16(s[c][i]);
+}
+
+void conv_s16_to_f32d_c(void *dst[], const void *src[], uint32_t n_channels, uint32_t n_frames)
+{
+	const int16_t *s = src[0];
+	float **d = (float **)dst;
+	uint32_t i, c;
+
+	for (i = 0; i < n_frames; i++)
+		for (c = 0; c < n_channels; c++)
+			d[c][i] = lindroid_s16_to_f32(*s++);
+}
+
+void format_ops_init(struct format_ops *ops, uint32_t cpu_flags)
+{
+	ops->name = "c";
+	ops->f32d_to_s16 = conv_f32d_to_s16_c;
+	ops->s16_to_f32d = conv_s16_to_f32d_c;
+
+#if defined(HAVE_SSE2)
+	if (cpu_flags & SPA_CPU_FLAG_SSE2) {
+		ops->name = "sse2";
+		ops->f32d_to_s16 = conv_f32d_to_s16_sse2;
+		ops->s16_to_f32d = conv_s16_to_f32d_sse2;
+	}
+#endif
+#if defined(HAVE_NEON)
+	if (cpu_flags & SPA_CPU_FLAG_NEON) {
+		ops->name = "neon";
+		ops->f32d_to_s16 = conv_f32d_to_s16_neon;
+		ops->s16_to_f32d = conv_s16_to_f32d_neon;
+	}
+#endif
+}
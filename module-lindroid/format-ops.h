@@ -0,0 +1,69 @@
+/* Lindroid sample format conversion */
+/* SPDX-FileCopyrightText: Copyright © 2024 Lindroid project */
+/* SPDX-License-Identifier: MIT */
+
+#ifndef LINDROID_FORMAT_OPS_H
+#define LINDROID_FORMAT_OPS_H
+
+#include <stdint.h>
+#include <math.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Conversion between the planar F32 samples of the PipeWire graph and the
+ * interleaved S16 samples the host speaks. Full scale is +-1.0 and maps to
+ * +-32767, out of range samples are clipped. Source and destination may be
+ * unaligned.
+ */
+#define LINDROID_S16_SCALE	32767.0f
+
+typedef void (*lindroid_convert_func_t) (void *dst[], const void *src[],
+		uint32_t n_channels, uint32_t n_frames);
+
+struct format_ops {
+	const char *name;		/**< kernel flavour, for the logs */
+	/** dst[0] is interleaved S16, src[] holds n_channels planes of F32 */
+	lindroid_convert_func_t f32d_to_s16;
+	/** dst[] holds n_channels planes of F32, src[0] is interleaved S16 */
+	lindroid_convert_func_t s16_to_f32d;
+};
+
+/** Pick the fastest kernels for the SPA_CPU_FLAG_* in cpu_flags */
+void format_ops_init(struct format_ops *ops, uint32_t cpu_flags);
+
+void conv_f32d_to_s16_c(void *dst[], const void *src[], uint32_t n_channels, uint32_t n_frames);
+void conv_s16_to_f32d_c(void *dst[], const void *src[], uint32_t n_channels, uint32_t n_frames);
+
+#if defined(HAVE_SSE2)
+void conv_f32d_to_s16_sse2(void *dst[], const void *src[], uint32_t n_channels, uint32_t n_frames);
+void conv_s16_to_f32d_sse2(void *dst[], const void *src[], uint32_t n_channels, uint32_t n_frames);
+#endif
+#if defined(HAVE_NEON)
+void conv_f32d_to_s16_neon(void *dst[], const void *src[], uint32_t n_channels, uint32_t n_frames);
+void conv_s16_to_f32d_neon(void *dst[], const void *src[], uint32_t n_channels, uint32_t n_frames);
+#endif
+
+static inline int16_t lindroid_f32_to_s16(float v)
+{
+	if (v <= -1.0f)
+		return -32767;
+	if (v >= 1.0f)
+		return 32767;
+	v *= LINDROID_S16_SCALE;
+	/* round to nearest even, like the vector conversions */
+	return (int16_t)lrintf(v);
+}
+
+static inline float lindroid_s16_to_f32(int16_t v)
+{
+	return v * (1.0f / LINDROID_S16_SCALE);
+}
+
+#ifdef __cplusplus
+}  /* extern "C" */
+#endif
+
+#endif /* LINDROID_FORMAT_OPS_H */
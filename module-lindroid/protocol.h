@@ -0,0 +1,160 @@
+/* Lindroid audio socket protocol */
+/* SPDX-FileCopyrightText: Copyright © 2024 Lindroid project */
+/* SPDX-License-Identifier: MIT */
+
+#ifndef LINDROID_PROTOCOL_H
+#define LINDROID_PROTOCOL_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The module and the Lindroid host app talk over a SOCK_STREAM socket. Every
+ * packet starts with a struct lindroid_header followed by `length` bytes of
+ * payload. All fields are in host byte order, both ends run on the same
+ * machine.
+ *
+ * After connecting, the module sends a HELLO with the highest version it
+ * speaks and the formats it proposes. The host answers with a HELLO holding
+ * the version and formats it accepted. No audio is exchanged before that.
+ *
+ * Playback can be split over several streams, told apart by the `stream`
+ * field of the header. Stream 0 is announced in the HELLO, the module
+ * announces every further stream with a LINDROID_PACKET_STREAM right after
+ * it. Hosts ignore packet types they do not know.
+ *
+ * When both sides set LINDROID_HELLO_FLAG_SHM, the module follows up with a
+ * LINDROID_PACKET_SHM carrying a memfd and an eventfd as SCM_RIGHTS. The
+ * memfd starts with a struct lindroid_shm_header describing one ring per
+ * direction, audio then flows through those rings and the socket is only
+ * used for control packets. The rings carry stream 0, the other playback
+ * streams stay on the socket.
+ *
+ * The module sends a LINDROID_PACKET_STATE when a stream goes idle, because
+ * nothing plays or records, or because playback was silent for a while, and
+ * again before its audio resumes. The host may release its AAudio stream
+ * meanwhile. No audio is sent for a suspended playback stream.
+ *
+ * When both sides set LINDROID_HELLO_FLAG_OPUS, audio packets on the socket
+ * may carry LINDROID_FORMAT_OPUS, one Opus packet of 10 ms with the rate and
+ * channels of the stream. Each packet says which format it holds, so both
+ * sides keep sending PCM for streams the codec does not take.
+ *
+ * Hosts that predate this protocol send and expect a single prefix byte
+ * (0x01 playback, 0x02 capture) in front of raw PCM. The magic byte is
+ * chosen so both can be told apart from the first byte.
+ */
+#define LINDROID_PROTOCOL_MAGIC		0x4c	/* 'L' */
+#define LINDROID_PROTOCOL_VERSION	1
+
+enum lindroid_packet_type {
+	LINDROID_PACKET_HELLO = 1,	/**< handshake, struct lindroid_hello */
+	LINDROID_PACKET_PLAYBACK,	/**< module to host audio */
+	LINDROID_PACKET_CAPTURE,	/**< host to module audio */
+	LINDROID_PACKET_SHM,		/**< module to host, struct lindroid_shm_info,
+					  *  memfd and eventfd attached */
+	LINDROID_PACKET_STREAM,		/**< module to host, struct lindroid_stream_info */
+	LINDROID_PACKET_LATENCY,	/**< host to module, struct lindroid_latency */
+	LINDROID_PACKET_STATE,		/**< module to host, struct lindroid_state */
+};
+
+#define LINDROID_HELLO_FLAG_SHM		(1u << 0)	/**< shared memory transport */
+#define LINDROID_HELLO_FLAG_LOW_LATENCY	(1u << 1)	/**< from the module: small quanta,
+							  *  please use an exclusive MMAP
+							  *  path. From the host: got one */
+#define LINDROID_HELLO_FLAG_OPUS	(1u << 2)	/**< Opus packets on the socket */
+
+enum lindroid_format {
+	LINDROID_FORMAT_UNKNOWN,
+	LINDROID_FORMAT_S16LE,
+	LINDROID_FORMAT_S24LE,
+	LINDROID_FORMAT_S32LE,
+	LINDROID_FORMAT_F32LE,
+	LINDROID_FORMAT_OPUS,		/**< one Opus packet, S16 when decoded */
+};
+
+struct lindroid_header {
+	uint8_t magic;		/**< LINDROID_PROTOCOL_MAGIC */
+	uint8_t version;	/**< protocol version of the sender */
+	uint8_t type;		/**< enum lindroid_packet_type */
+	uint8_t stream;		/**< stream index, 0 for the default sink and source */
+	uint32_t length;	/**< payload bytes following the header */
+	uint32_t seq;		/**< per type and stream, incremented for each packet */
+	uint32_t format;	/**< enum lindroid_format of the payload */
+	uint64_t timestamp;	/**< sample clock of the first frame in the payload */
+} __attribute__((packed));
+
+struct lindroid_format_info {
+	uint32_t format;	/**< enum lindroid_format */
+	uint32_t rate;
+	uint32_t channels;
+} __attribute__((packed));
+
+/** Payload of LINDROID_PACKET_HELLO. Receivers ignore trailing bytes they
+ * do not know and zero fill a shorter payload. */
+struct lindroid_hello {
+	uint32_t version;	/**< highest protocol version spoken */
+	uint32_t flags;		/**< LINDROID_HELLO_FLAG_* */
+	struct lindroid_format_info playback;
+	struct lindroid_format_info capture;
+} __attribute__((packed));
+
+/** Payload of LINDROID_PACKET_STREAM, the header carries the stream index */
+struct lindroid_stream_info {
+	struct lindroid_format_info format;
+	char name[64];		/**< node name, nul terminated */
+	char role[32];		/**< media.role of the stream, empty if unset */
+} __attribute__((packed));
+
+/** Payload of LINDROID_PACKET_LATENCY, sent by the host whenever its
+ * buffering changes. The header carries the stream index. */
+struct lindroid_latency {
+	uint32_t direction;	/**< LINDROID_PACKET_PLAYBACK or LINDROID_PACKET_CAPTURE */
+	uint32_t buffered;	/**< frames queued in the host app */
+	uint32_t device;	/**< frames of latency in the Android HAL and device */
+} __attribute__((packed));
+
+enum lindroid_stream_state {
+	LINDROID_STATE_RUNNING,
+	LINDROID_STATE_SUSPENDED,
+};
+
+/** Payload of LINDROID_PACKET_STATE, the header carries the stream index */
+struct lindroid_state {
+	uint32_t direction;	/**< LINDROID_PACKET_PLAYBACK or LINDROID_PACKET_CAPTURE */
+	uint32_t state;		/**< enum lindroid_stream_state */
+} __attribute__((packed));
+
+/** One ring in the shared memory. The indexes are free running byte
+ * counters, updated with release semantics after the data is written or
+ * consumed, the first 8 bytes are layout compatible with spa_ringbuffer. */
+struct lindroid_shm_ring {
+	uint32_t readindex;
+	uint32_t writeindex;
+	uint32_t offset;	/**< data offset from the start of the memfd */
+	uint32_t size;		/**< data size, a power of two */
+	uint32_t high_water;	/**< bytes the reader keeps queued at most, 0 for no limit */
+	uint32_t padding[11];	/**< keep each ring on its own cache line */
+};
+
+struct lindroid_shm_header {
+	struct lindroid_shm_ring playback;	/**< written by the module, read by the host */
+	struct lindroid_shm_ring capture;	/**< written by the host, read by the module */
+};
+
+/** Payload of LINDROID_PACKET_SHM. The memfd is the first file descriptor,
+ * the eventfd that the module signals after writing playback audio the
+ * second. Capture audio is polled by the module on every graph cycle. */
+struct lindroid_shm_info {
+	uint32_t size;		/**< size of the memfd */
+	uint32_t flags;		/**< none defined yet */
+};
+
+#ifdef __cplusplus
+}  /* extern "C" */
+#endif
+
+#endif /* LINDROID_PROTOCOL_H */
@@ -0,0 +1,224 @@
+/* Lindroid socket and ring transport */
+/* SPDX-FileCopyrightText: Copyright © 2024 Lindroid project */
+/* SPDX-License-Identifier: MIT */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <spa/utils/defs.h>
+
+#include "transport.h"
+
+void ring_init(struct ring *ring, struct lindroid_shm_header *shm,
+		struct lindroid_shm_ring *desc, uint32_t offset, uint32_t size)
+{
+	desc->readindex = desc->writeindex = 0;
+	desc->offset = offset;
+	desc->size = size;
+
+	ring->rb = (struct spa_ringbuffer *)desc;
+	ring->data = SPA_PTROFF(shm, offset, uint8_t);
+	ring->size = size;
+	ring->mask = size - 1;
+}
+
+void ring_init_local(struct ring *ring, struct spa_ringbuffer *rb,
+		uint8_t *data, uint32_t size)
+{
+	spa_ringbuffer_init(rb);
+	ring->rb = rb;
+	ring->data = data;
+	ring->size = size;
+	ring->mask = size - 1;
+}
+
+int ring_iov(const struct ring *ring, uint32_t index, uint32_t len, struct iovec *iov)
+{
+	uint32_t offs = index & ring->mask;
+	uint32_t l0 = SPA_MIN(len, ring->size - offs);
+
+	iov[0].iov_base = ring->data + offs;
+	iov[0].iov_len = l0;
+	if (l0 == len)
+		return 1;
+
+	iov[1].iov_base = ring->data;
+	iov[1].iov_len = len - l0;
+	return 2;
+}
+
+uint32_t ring_free(const struct ring *ring, uint32_t *index)
+{
+	int32_t filled = spa_ringbuffer_get_write_index(ring->rb, index);
+	return ring->size - SPA_CLAMP(filled, 0, (int32_t)ring->size);
+}
+
+void packet_writer_prepare(struct packet_writer *w, uint8_t type, uint8_t stream,
+		uint32_t format, uint32_t seq, uint64_t timestamp, uint32_t length)
+{
+	struct lindroid_header *hdr = (struct lindroid_header *)w->header;
+
+	hdr->magic = LINDROID_PROTOCOL_MAGIC;
+	hdr->version = LINDROID_PROTOCOL_VERSION;
+	hdr->type = type;
+	hdr->stream = stream;
+	hdr->length = length;
+	hdr->seq = seq;
+	hdr->format = format;
+	hdr->timestamp = timestamp;
+
+	w->header_size = sizeof(*hdr);
+	w->offset = 0;
+	w->size = sizeof(*hdr) + length;
+}
+
+ssize_t packet_writer_send(struct packet_writer *w, int fd)
+{
+	struct iovec iov[3];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	union {
+		char buf[CMSG_SPACE(sizeof(w->fds))];
+		struct cmsghdr align;
+	} cmsgbuf;
+	uint32_t offs, len;
+	ssize_t sent;
+	int n_iov = 0;
+
+	/* header and payload, skipping what was sent already */
+	offs = w->offset;
+	if (offs < w->header_size) {
+		iov[n_iov].iov_base = w->header + offs;
+		iov[n_iov].iov_len = w->header_size - offs;
+		n_iov++;
+		offs = 0;
+	} else {
+		offs -= w->header_size;
+	}
+	len = w->size - w->header_size - offs;
+	if (len > 0 && w->data != NULL) {
+		iov[n_iov].iov_base = (void *)SPA_PTROFF(w->data, offs, const void);
+		iov[n_iov].iov_len = len;
+		n_iov++;
+	} else if (len > 0) {
+		n_iov += ring_iov(w->ring, w->index + offs, len, &iov[n_iov]);
+	}
+
+	spa_zero(msg);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = n_iov;
+
+	if (w->n_fds > 0) {
+		len = w->n_fds * sizeof(int);
+		msg.msg_control = cmsgbuf.buf;
+		msg.msg_controllen = CMSG_SPACE(len);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(len);
+		memcpy(CMSG_DATA(cmsg), w->fds, len);
+	}
+
+	sent = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (sent < 0)
+		return errno == EWOULDBLOCK ? -EAGAIN : -errno;
+
+	w->offset += sent;
+	w->n_fds = 0;
+	return sent;
+}
+
+int packet_reader_recv(struct packet_reader *r, int fd, struct iovec *iov, int n_iov)
+{
+	struct iovec vec[LINDROID_RECV_MAX_IOV + 1];
+	struct msghdr msg;
+	ssize_t res;
+	bool buffered;
+
+	if (n_iov > LINDROID_RECV_MAX_IOV)
+		return -EINVAL;
+
+	while (n_iov > 0) {
+		buffered = packet_reader_buffered(r) > 0;
+		if (buffered) {
+			res = SPA_MIN(iov->iov_len, packet_reader_buffered(r));
+			memcpy(iov->iov_base, r->buf + r->offset, res);
+			r->offset += res;
+		} else {
+			memcpy(vec, iov, n_iov * sizeof(*iov));
+			vec[n_iov].iov_base = r->buf;
+			vec[n_iov].iov_len = sizeof(r->buf);
+
+			spa_zero(msg);
+			msg.msg_iov = vec;
+			msg.msg_iovlen = n_iov + 1;
+
+			res = recvmsg(fd, &msg, 0);
+			if (res < 0) {
+				if (errno == EINTR)
+					continue;
+				return -errno;
+			}
+			if (res == 0)
+				return -EPIPE;
+			packet_reader_reset(r);
+		}
+
+		while (n_iov > 0 && (size_t)res >= iov->iov_len) {
+			res -= iov->iov_len;
+			iov++;
+			n_iov--;
+		}
+		if (n_iov > 0) {
+			iov->iov_base = SPA_PTROFF(iov->iov_base, res, void);
+			iov->iov_len -= res;
+		} else if (!buffered) {
+			/* read ahead, only left over from a recvmsg */
+			r->size = res;
+		}
+	}
+	return 0;
+}
+
+int packet_reader_discard(struct packet_reader *r, int fd, uint32_t len)
+{
+	uint8_t discard[4096];
+	struct iovec iov;
+	int res;
+
+	while (len > 0) {
+		iov.iov_base = discard;
+		iov.iov_len = SPA_MIN(len, sizeof(discard));
+		len -= iov.iov_len;
+		if ((res = packet_reader_recv(r, fd, &iov, 1)) < 0)
+			return res;
+	}
+	return 0;
+}
+
+int packet_reader_header(struct packet_reader *r, int fd, struct lindroid_header *hdr,
+		uint32_t max_length, uint32_t *resyncs)
+{
+	uint8_t *p = (uint8_t *)hdr;
+	uint32_t have = 0, i;
+	struct iovec iov;
+	int res;
+
+	while (true) {
+		iov.iov_base = p + have;
+		iov.iov_len = sizeof(*hdr) - have;
+		if ((res = packet_reader_recv(r, fd, &iov, 1)) < 0)
+			return res;
+
+		if (hdr->magic == LINDROID_PROTOCOL_MAGIC && hdr->version > 0 &&
+		    hdr->length <= max_length)
+			return 0;
+
+		/* lost sync, continue from the next magic byte */
+		for (i = 1; i < sizeof(*hdr) && p[i] != LINDROID_PROTOCOL_MAGIC; i++);
+		have = sizeof(*hdr) - i;
+		memmove(p, p + i, have);
+		(*resyncs)++;
+	}
+}
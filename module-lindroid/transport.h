@@ -0,0 +1,116 @@
+/* Lindroid socket and ring transport */
+/* SPDX-FileCopyrightText: Copyright © 2024 Lindroid project */
+/* SPDX-License-Identifier: MIT */
+
+#ifndef LINDROID_TRANSPORT_H
+#define LINDROID_TRANSPORT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <spa/utils/ringbuffer.h>
+
+#include "protocol.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The pieces of the transport shared by the module and the benchmark: the
+ * audio rings, the framing of packets on the socket, a sender that never
+ * blocks and a receiver with read ahead that does.
+ */
+
+/* largest packet the host reads in one go, header included. Larger periods
+ * go out as several packets and come back together in the rings. */
+#define LINDROID_MAX_PACKET_SIZE	10240
+
+/* receive read ahead, lets one syscall pick up several small packets */
+#define LINDROID_RECV_AHEAD_SIZE	16384
+#define LINDROID_RECV_MAX_IOV		4
+
+/** A ring of size bytes, a power of two, in local or shared memory */
+struct ring {
+	struct spa_ringbuffer *rb;
+	uint8_t *data;
+	uint32_t size;
+	uint32_t mask;
+};
+
+/** Set up a ring in the shared memory at shm, described by desc */
+void ring_init(struct ring *ring, struct lindroid_shm_header *shm,
+		struct lindroid_shm_ring *desc, uint32_t offset, uint32_t size);
+void ring_init_local(struct ring *ring, struct spa_ringbuffer *rb,
+		uint8_t *data, uint32_t size);
+/** Describe len bytes of a ring starting at index as up to two iovecs */
+int ring_iov(const struct ring *ring, uint32_t index, uint32_t len, struct iovec *iov);
+/** Bytes that can be written, the write index is returned in index */
+uint32_t ring_free(const struct ring *ring, uint32_t *index);
+
+/**
+ * A packet on its way out. The header is followed by the payload in data
+ * or, when data is NULL, by the bytes of ring from index on, which stay in
+ * the ring until the packet is sent. File descriptors travel with the
+ * first byte.
+ */
+struct packet_writer {
+	uint8_t header[sizeof(struct lindroid_header)];
+	uint32_t header_size;
+	const void *data;
+	const struct ring *ring;
+	uint32_t index;
+	uint32_t offset;	/**< bytes sent so far, header included */
+	uint32_t size;		/**< header and payload */
+	int fds[2];
+	uint32_t n_fds;
+};
+
+/** Frame a packet of length payload bytes, the payload source is set after */
+void packet_writer_prepare(struct packet_writer *w, uint8_t type, uint8_t stream,
+		uint32_t format, uint32_t seq, uint64_t timestamp, uint32_t length);
+
+static inline bool packet_writer_done(const struct packet_writer *w)
+{
+	return w->offset == w->size;
+}
+
+/** Send what is left of the packet without blocking. Returns the bytes
+ * sent, or a negative errno, -EAGAIN when the socket is full. */
+ssize_t packet_writer_send(struct packet_writer *w, int fd);
+
+/** Framed packets coming in over a blocking socket */
+struct packet_reader {
+	uint8_t buf[LINDROID_RECV_AHEAD_SIZE];
+	uint32_t offset;
+	uint32_t size;
+};
+
+static inline void packet_reader_reset(struct packet_reader *r)
+{
+	r->offset = r->size = 0;
+}
+
+static inline uint32_t packet_reader_buffered(const struct packet_reader *r)
+{
+	return r->size - r->offset;
+}
+
+/** Receive exactly the size of all iovecs, blocking. The read ahead is used
+ * first, and reading from the socket also takes whatever else arrived
+ * already, so a burst of small packets costs one syscall and not two per
+ * packet. At most LINDROID_RECV_MAX_IOV iovecs, which are consumed. */
+int packet_reader_recv(struct packet_reader *r, int fd, struct iovec *iov, int n_iov);
+int packet_reader_discard(struct packet_reader *r, int fd, uint32_t len);
+/** Receive the next header with a payload of at most max_length. After
+ * garbage it continues from the next magic byte, counted in resyncs. */
+int packet_reader_header(struct packet_reader *r, int fd, struct lindroid_header *hdr,
+		uint32_t max_length, uint32_t *resyncs);
+
+#ifdef __cplusplus
+}  /* extern "C" */
+#endif
+
+#endif /* LINDROID_TRANSPORT_H */